@@ -21,7 +21,7 @@ unix:!macx {
         PKGCONFIG += taglib taglib-extras
 #    }
     CONFIG += link_pkgconfig
-    PKGCONFIG += gstreamer-1.0 gstreamer-app-1.0 gstreamer-audio-1.0 gstreamer-pbutils-1.0 gstreamer-controller-1.0
+    PKGCONFIG += gstreamer-1.0 gstreamer-app-1.0 gstreamer-audio-1.0 gstreamer-pbutils-1.0 gstreamer-controller-1.0 zlib
     iconfiles.files += Icons/okjicon.svg
     iconfiles.path = $$PREFIX/share/pixmaps
     desktopfiles.files += openkj.desktop
@@ -35,6 +35,7 @@ unix:!macx {
 macx: {
     LIBS += -F/Library/Frameworks -framework GStreamer
     INCLUDEPATH += /Library/Frameworks/GStreamer.framework/Headers
+    LIBS += -lz
     ICON = Icons/OpenKJ.icns
     DEFINES += STATIC_TAGLIB
 }
@@ -49,14 +50,14 @@ win32 {
         INCLUDEPATH += C:\gstreamer\1.0\x86\include\glib-2.0
         INCLUDEPATH += C:\gstreamer\1.0\x86\lib\glib-2.0\include
         INCLUDEPATH += C:\gstreamer\1.0\x86\include\glib-2.0\gobject
-        LIBS += -LC:\gstreamer\1.0\x86\lib -lgstreamer-1.0 -lglib-2.0 -lgobject-2.0 -lgstapp-1.0 -lgstaudio-1.0 -lgstpbutils-1.0 -lgstcontroller-1.0
+        LIBS += -LC:\gstreamer\1.0\x86\lib -lgstreamer-1.0 -lglib-2.0 -lgobject-2.0 -lgstapp-1.0 -lgstaudio-1.0 -lgstpbutils-1.0 -lgstcontroller-1.0 -lz
     } else {
         ## Windows x64 (64bit) specific build here
         INCLUDEPATH += C:\gstreamer\1.0\x86_64\include\gstreamer-1.0
         INCLUDEPATH += C:\gstreamer\1.0\x86_64\include\glib-2.0
         INCLUDEPATH += C:\gstreamer\1.0\x86_64\lib\glib-2.0\include
         INCLUDEPATH += C:\gstreamer\1.0\x86_64\include\glib-2.0\gobject
-        LIBS += -LC:\gstreamer\1.0\x86_64\lib -lgstreamer-1.0 -lglib-2.0 -lgobject-2.0 -lgstapp-1.0 -lgstaudio-1.0 -lgstpbutils-1.0 -lgstcontroller-1.0
+        LIBS += -LC:\gstreamer\1.0\x86_64\lib -lgstreamer-1.0 -lglib-2.0 -lgobject-2.0 -lgstapp-1.0 -lgstaudio-1.0 -lgstpbutils-1.0 -lgstcontroller-1.0 -lz
     }
 }
 
@@ -115,6 +116,8 @@ DEFINES += BUILD_DATE=__DATE__
 SOURCES += main.cpp\
     mainwindow.cpp \
     libCDG/src/libCDG_Frame_Image.cpp \
+    libCDG/src/libCDG_Frame_Store.cpp \
+    libCDG/src/libCDG_Expand.cpp \
     libCDG/src/libCDG_Color.cpp \
     libCDG/src/libCDG.cpp \
     sourcedirtablemodel.cpp \
@@ -140,6 +143,12 @@ SOURCES += main.cpp\
     queueitemdelegate.cpp \
     regitemdelegate.cpp \
     okarchive.cpp \
+    cdgcache.cpp \
+    songprefetcher.cpp \
+    songloader.cpp \
+    libraryauditor.cpp \
+    dirwalker.cpp \
+    siblingindex.cpp \
     cdgvideosurface.cpp \
     cdgvideowidget.cpp \
     abstractaudiobackend.cpp \
@@ -285,6 +294,8 @@ contains(DEFINES, STATIC_TAGLIB) {
 HEADERS  += mainwindow.h \
     libCDG/include/libCDG.h \
     libCDG/include/libCDG_Frame_Image.h \
+    libCDG/include/libCDG_Frame_Store.h \
+    libCDG/include/libCDG_Expand.h \
     libCDG/include/libCDG_Color.h \
     sourcedirtablemodel.h \
     dbupdatethread.h \
@@ -309,6 +320,12 @@ HEADERS  += mainwindow.h \
     queueitemdelegate.h \
     regitemdelegate.h \
     okarchive.h \
+    cdgcache.h \
+    songprefetcher.h \
+    songloader.h \
+    libraryauditor.h \
+    dirwalker.h \
+    siblingindex.h \
     cdgvideosurface.h \
     cdgvideowidget.h \
     abstractaudiobackend.h \
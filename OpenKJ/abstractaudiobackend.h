@@ -22,6 +22,7 @@
 #define ABSTRACTAUDIOBACKEND_H
 
 #include <QObject>
+#include <QIODevice>
 #include <QStringList>
 #include <QImage>
 
@@ -81,6 +82,8 @@ public slots:
     virtual void play() {}
     virtual void pause() {}
     virtual void setMedia(QString filename) {Q_UNUSED(filename);}
+    // Play from a device rather than a file, for example an audio file inside a zip.  Takes ownership of the device.
+    virtual void setMedia(QIODevice *device) {delete device;}
     virtual void setMuted(bool muted) {Q_UNUSED(muted);}
     virtual void setPosition(qint64 position) {Q_UNUSED(position);}
     virtual void setVolume(int volume) {Q_UNUSED(volume);}
@@ -56,6 +56,7 @@ AudioBackendGstreamer::AudioBackendGstreamer(bool loadPitchShift, QObject *paren
     m_keyChange = 0;
     m_silenceDuration = 0;
     m_muted = false;
+    mediaDevice = NULL;
     isFading = false;
     eq1 = 0;
     eq2 = 0;
@@ -88,6 +89,7 @@ AudioBackendGstreamer::AudioBackendGstreamer(bool loadPitchShift, QObject *paren
     pitchShifterRubberBand = gst_element_factory_make("ladspa-ladspa-rubberband-so-rubberband-pitchshifter-stereo", "ladspa-ladspa-rubberband-so-rubberband-pitchshifter-stereo");
     equalizer = gst_element_factory_make("equalizer-10bands", NULL);
     playBin = gst_element_factory_make("playbin", "playBin");
+    g_signal_connect(playBin, "source-setup", G_CALLBACK(this->cb_source_setup), this);
     fltrMplxInput = gst_element_factory_make("capsfilter", "filter");
     fltrEnd = gst_element_factory_make("capsfilter", NULL);
     audioCapsStereo = gst_caps_new_simple("audio/x-raw", "channels", G_TYPE_INT, 2, NULL);
@@ -258,6 +260,7 @@ AudioBackendGstreamer::AudioBackendGstreamer(bool loadPitchShift, QObject *paren
 
 AudioBackendGstreamer::~AudioBackendGstreamer()
 {
+    delete mediaDevice;
 }
 
 
@@ -432,6 +435,10 @@ void AudioBackendGstreamer::setMedia(QString filename)
 {
     m_hasVideo = false;
     m_filename = filename;
+    mediaDeviceMutex.lock();
+    delete mediaDevice;
+    mediaDevice = NULL;
+    mediaDeviceMutex.unlock();
 #ifdef Q_OS_WIN
     std::string uri = "file:///" + filename.toStdString();
 #else
@@ -441,6 +448,19 @@ void AudioBackendGstreamer::setMedia(QString filename)
     g_object_set(GST_OBJECT(playBin), "uri", uri.c_str(), NULL);
 }
 
+void AudioBackendGstreamer::setMedia(QIODevice *device)
+{
+    m_hasVideo = false;
+    m_filename = "";
+    mediaDeviceMutex.lock();
+    delete mediaDevice;
+    mediaDevice = device;
+    mediaDeviceMutex.unlock();
+    // playbin creates an appsrc for this uri and hands it to cb_source_setup, which feeds it from the device
+    qDebug() << "AudioBackendHybrid - Playing from device";
+    g_object_set(GST_OBJECT(playBin), "uri", "appsrc://", NULL);
+}
+
 void AudioBackendGstreamer::setMuted(bool muted)
 {
     if (muted)
@@ -932,6 +952,58 @@ GstFlowReturn AudioBackendGstreamer::NewSampleCallback(GstAppSink* appsink, gpoi
 
 }
 
+void AudioBackendGstreamer::cb_source_setup(GstElement *playbin, GstElement *source, gpointer data)
+{
+    Q_UNUSED(playbin);
+    AudioBackendGstreamer *parent = reinterpret_cast<AudioBackendGstreamer*>(data);
+    if (!GST_IS_APP_SRC(source))
+        return;
+    GstAppSrcCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.need_data = cb_need_data;
+    callbacks.seek_data = cb_seek_data;
+    parent->mediaDeviceMutex.lock();
+    gint64 size = (parent->mediaDevice) ? parent->mediaDevice->size() : -1;
+    parent->mediaDeviceMutex.unlock();
+    g_object_set(source, "size", size, "stream-type", GST_APP_STREAM_TYPE_SEEKABLE, NULL);
+    gst_app_src_set_callbacks(GST_APP_SRC(source), &callbacks, parent, NULL);
+}
+
+void AudioBackendGstreamer::cb_need_data(GstAppSrc *appsrc, guint length, gpointer data)
+{
+    AudioBackendGstreamer *parent = reinterpret_cast<AudioBackendGstreamer*>(data);
+    // Called from the streaming thread, so the device is only touched under the mutex
+    if ((length == 0) || (length > 65536))
+        length = 65536;
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, length, NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    qint64 bytes = -1;
+    parent->mediaDeviceMutex.lock();
+    if (parent->mediaDevice)
+        bytes = parent->mediaDevice->read((char *)map.data, length);
+    parent->mediaDeviceMutex.unlock();
+    gst_buffer_unmap(buffer, &map);
+    if (bytes <= 0)
+    {
+        gst_buffer_unref(buffer);
+        gst_app_src_end_of_stream(appsrc);
+        return;
+    }
+    gst_buffer_set_size(buffer, bytes);
+    gst_app_src_push_buffer(appsrc, buffer);
+}
+
+gboolean AudioBackendGstreamer::cb_seek_data(GstAppSrc *appsrc, guint64 offset, gpointer data)
+{
+    Q_UNUSED(appsrc);
+    AudioBackendGstreamer *parent = reinterpret_cast<AudioBackendGstreamer*>(data);
+    QMutexLocker locker(&parent->mediaDeviceMutex);
+    if (!parent->mediaDevice)
+        return FALSE;
+    return parent->mediaDevice->seek(offset);
+}
+
 void AudioBackendGstreamer::cb_new_pad(GstElement *element, GstPad *pad, gpointer data)
 {
     Q_UNUSED(element);
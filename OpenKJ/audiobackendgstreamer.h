@@ -25,6 +25,7 @@
 #define GLIB_DISABLE_DEPRECATION_WARNINGS
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
 #include <gst/gstdevicemonitor.h>
 #include <gst/gstdevice.h>
 #include <gst/gstplugin.h>
@@ -33,6 +34,7 @@
 
 #include <QTimer>
 #include <QThread>
+#include <QMutex>
 #include <QImage>
 #include <QAudioOutput>
 #include "audiofader.h"
@@ -100,6 +102,8 @@ private:
     GstControlSource *csource;
     GstTimedValueControlSource *tv_csource;
     QString m_filename;
+    QIODevice *mediaDevice;
+    QMutex mediaDeviceMutex;
     QTimer *fastTimer;
     QTimer *slowTimer;
     int m_keyChange;
@@ -126,6 +130,9 @@ private:
     static GstFlowReturn NewSampleCallback(GstAppSink *appsink, gpointer user_data);
     static GstFlowReturn NewAudioSampleCallback(GstAppSink *appsink, gpointer user_data);
     static void cb_new_pad (GstElement *element, GstPad *pad, gpointer data);
+    static void cb_source_setup(GstElement *playbin, GstElement *source, gpointer data);
+    static void cb_need_data(GstAppSrc *appsrc, guint length, gpointer data);
+    static gboolean cb_seek_data(GstAppSrc *appsrc, guint64 offset, gpointer data);
 
     QStringList GstGetPlugins();
     QStringList GstGetElements(QString plugin);
@@ -169,6 +176,7 @@ public slots:
     void play();
     void pause();
     void setMedia(QString filename);
+    void setMedia(QIODevice *device);
     void setMuted(bool muted);
     void setPosition(qint64 position);
     void setVolume(int volume);
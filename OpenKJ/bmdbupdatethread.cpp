@@ -20,10 +20,10 @@
 
 #include "bmdbupdatethread.h"
 #include <QDir>
-#include <QDirIterator>
 #include <QSqlQuery>
 #include <QFileInfo>
 #include "tagreader.h"
+#include "dirwalker.h"
 #include <QtConcurrent>
 
 BmDbUpdateThread::BmDbUpdateThread(QObject *parent) :
@@ -55,11 +55,14 @@ QStringList BmDbUpdateThread::findMediaFiles(QString directory)
 {
     QStringList files;
     QDir dir(directory);
-    QDirIterator iterator(dir.absolutePath(), QDirIterator::Subdirectories);
-    while (iterator.hasNext()) {
-        iterator.next();
-        if (!iterator.fileInfo().isDir()) {
-            QString filename = iterator.filePath();
+    DirWalker walker;
+    walker.start(QStringList() << dir.absolutePath());
+    DirListing listing;
+    while (walker.next(listing))
+    {
+        for (int f=0; f < listing.files.size(); f++)
+        {
+            QString filename = listing.files.at(f);
             for (int i=0; i<supportedExtensions.size(); i++)
             {
                 if (filename.endsWith(supportedExtensions.at(i),Qt::CaseInsensitive))
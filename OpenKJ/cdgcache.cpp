@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cdgcache.h"
+#include "okarchive.h"
+#include "settings.h"
+#include "songprefetcher.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtConcurrent>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+extern Settings *settings;
+
+CdgCache::CdgCache(QObject *parent) : QObject(parent)
+{
+    cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QDir::separator() + "cdg";
+    QDir().mkpath(cacheDir);
+    stopping = 0;
+    workerActive = false;
+    prefetcher = NULL;
+    maxSize = settings->cdgCacheMaxSize();
+    connect(settings, SIGNAL(cdgCacheMaxSizeChanged(int)), this, SLOT(setMaxSize(int)));
+}
+
+CdgCache::~CdgCache()
+{
+    stopping = 1;
+    mutex.lock();
+    pendingFiles.clear();
+    pendingData.clear();
+    mutex.unlock();
+    worker.waitForFinished();
+}
+
+bool CdgCache::open(CDG *cdg, const QByteArray &cdgData, bool stream)
+{
+    if (load(cdg, cdgData))
+        return true;
+    cdg->VideoClose();
+    cdg->FileOpen(cdgData);
+    if (!stream)
+    {
+        bool result = cdg->Process();
+        store(cdg, cdgData);
+        return result;
+    }
+    // Start streaming right away and fill the cache in the background for next time
+    mutex.lock();
+    pendingData.append(cdgData);
+    if (!workerActive)
+    {
+        workerActive = true;
+        worker = QtConcurrent::run(this, &CdgCache::processPending);
+    }
+    mutex.unlock();
+    return cdg->StreamStart();
+}
+
+void CdgCache::setPrefetcher(SongPrefetcher *prefetcher)
+{
+    this->prefetcher = prefetcher;
+}
+
+bool CdgCache::load(CDG *cdg, const QByteArray &cdgData)
+{
+    return loadFile(cdg, cacheFile(cdgData));
+}
+
+bool CdgCache::loadFile(CDG *cdg, const QString &fileName)
+{
+    if (maxSize <= 0)
+        return false;
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    uchar *map = file.map(0, file.size());
+    bool result;
+    if (map)
+    {
+        result = cdg->LoadTimeline((const char *)map, file.size());
+        file.unmap(map);
+    }
+    else
+    {
+        QByteArray timeline = file.readAll();
+        result = cdg->LoadTimeline(timeline.constData(), timeline.size());
+    }
+    file.close();
+    if (!result)
+    {
+        qWarning() << "CdgCache - Discarding invalid cache file " << file.fileName();
+        QFile::remove(file.fileName());
+        return false;
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    // Touch the file so eviction sees it as recently used
+    if (file.open(QIODevice::ReadWrite))
+    {
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        file.close();
+    }
+#endif
+    return true;
+}
+
+void CdgCache::store(CDG *cdg, const QByteArray &cdgData)
+{
+    if (maxSize <= 0)
+        return;
+    storeTimeline(cacheFile(cdgData), cdg->SaveTimeline());
+}
+
+bool CdgCache::openFile(CDG *cdg, QString karaokeFilePath)
+{
+    // A song that was decoded before is loaded straight from its timeline, without reading the karaoke file again
+    QString fileName = localFile(karaokeFilePath);
+    QString cached = knownCacheFile(fileName);
+    if ((!cached.isEmpty()) && (loadFile(cdg, cached)))
+        return true;
+    QByteArray cdgData = readCdgData(fileName);
+    if (cdgData.isEmpty())
+        return false;
+    remember(fileName, cacheFile(cdgData));
+    return open(cdg, cdgData, false);
+}
+
+QString CdgCache::localFile(QString karaokeFilePath)
+{
+    if (prefetcher)
+        return prefetcher->cachedPath(karaokeFilePath);
+    return karaokeFilePath;
+}
+
+QString CdgCache::knownCacheFile(QString fileName)
+{
+    QFileInfo info(fileName);
+    QMutexLocker locker(&mutex);
+    QHash<QString, KnownFile>::const_iterator known = knownFiles.constFind(fileName);
+    if ((known == knownFiles.constEnd()) || (known.value().mtime != info.lastModified().toMSecsSinceEpoch()) || (known.value().size != info.size()))
+        return QString();
+    if (!QFile::exists(known.value().cacheFile))
+        return QString();
+    return known.value().cacheFile;
+}
+
+void CdgCache::remember(QString fileName, QString timelineFile)
+{
+    QFileInfo info(fileName);
+    KnownFile known;
+    known.mtime = info.lastModified().toMSecsSinceEpoch();
+    known.size = info.size();
+    known.cacheFile = timelineFile;
+    QMutexLocker locker(&mutex);
+    knownFiles.insert(fileName, known);
+}
+
+bool CdgCache::contains(const QByteArray &cdgData)
+{
+    return QFile::exists(cacheFile(cdgData));
+}
+
+void CdgCache::warmUp(QStringList files)
+{
+    if (maxSize <= 0)
+        return;
+    QMutexLocker locker(&mutex);
+    // The rotation changes all the time, the same list doesn't need another pass
+    if (files == warmList)
+        return;
+    warmList = files;
+    pendingFiles = files;
+    if ((!pendingFiles.isEmpty()) && (!workerActive))
+    {
+        workerActive = true;
+        worker = QtConcurrent::run(this, &CdgCache::processPending);
+    }
+}
+
+QByteArray CdgCache::readCdgData(QString karaokeFilePath)
+{
+    if (karaokeFilePath.endsWith(".zip", Qt::CaseInsensitive))
+    {
+        OkArchive archive(karaokeFilePath);
+        if (!archive.checkCDG())
+            return QByteArray();
+        return archive.getCDGData();
+    }
+    if (karaokeFilePath.endsWith(".cdg", Qt::CaseInsensitive))
+    {
+        QFile file(karaokeFilePath);
+        if (!file.open(QIODevice::ReadOnly))
+            return QByteArray();
+        // Read through a read-only mapping with sequential read-ahead, falling back to a plain read
+        uchar *map = file.map(0, file.size());
+        if (!map)
+            return file.readAll();
+#ifdef Q_OS_UNIX
+        posix_madvise(map, file.size(), POSIX_MADV_SEQUENTIAL);
+        posix_madvise(map, file.size(), POSIX_MADV_WILLNEED);
+#endif
+        QByteArray data((const char *)map, file.size());
+        file.unmap(map);
+        return data;
+    }
+    return QByteArray();
+}
+
+void CdgCache::setMaxSize(int megabytes)
+{
+    maxSize = megabytes;
+}
+
+QString CdgCache::cacheFile(const QByteArray &cdgData)
+{
+    return cacheDir + QDir::separator() + QCryptographicHash::hash(cdgData, QCryptographicHash::Sha1).toHex() + ".okcdg";
+}
+
+void CdgCache::storeTimeline(const QString &fileName, const QByteArray &timeline)
+{
+    if (timeline.isEmpty())
+        return;
+    // QSaveFile writes to a temp file and renames it, so a reader never sees a partial timeline
+    QSaveFile file(fileName);
+    if ((!file.open(QIODevice::WriteOnly)) || (file.write(timeline) != timeline.size()) || (!file.commit()))
+    {
+        qWarning() << "CdgCache - Unable to write cache file " << fileName;
+        return;
+    }
+    evict();
+}
+
+void CdgCache::evict()
+{
+    qint64 maxBytes = (qint64)maxSize.load() * 1024 * 1024;
+    QDir dir(cacheDir);
+    // Newest first, anything past the size cap goes
+    QFileInfoList entries = dir.entryInfoList(QStringList() << "*.okcdg", QDir::Files, QDir::Time);
+    qint64 total = 0;
+    for (int i=0; i < entries.size(); i++)
+    {
+        total += entries.at(i).size();
+        if (total > maxBytes)
+            QFile::remove(entries.at(i).absoluteFilePath());
+    }
+}
+
+void CdgCache::processPending()
+{
+    forever
+    {
+        QByteArray cdgData;
+        mutex.lock();
+        // Decided under the mutex, so work queued while the worker is on its way out starts a new one
+        if (stopping)
+        {
+            workerActive = false;
+            mutex.unlock();
+            return;
+        }
+        if (!pendingData.isEmpty())
+            cdgData = pendingData.takeFirst();
+        else if (!pendingFiles.isEmpty())
+        {
+            QString fileName = pendingFiles.takeFirst();
+            mutex.unlock();
+            // Skips songs that are already cached without reading them off the share
+            fileName = localFile(fileName);
+            if (knownCacheFile(fileName).isEmpty())
+            {
+                cdgData = readCdgData(fileName);
+                if (!cdgData.isEmpty())
+                    remember(fileName, cacheFile(cdgData));
+            }
+            mutex.lock();
+        }
+        else
+        {
+            workerActive = false;
+            mutex.unlock();
+            return;
+        }
+        mutex.unlock();
+        if ((cdgData.isEmpty()) || (contains(cdgData)))
+            continue;
+        CDG decoder;
+        decoder.FileOpen(cdgData);
+        if (decoder.Process())
+            storeTimeline(cacheFile(cdgData), decoder.SaveTimeline());
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CDGCACHE_H
+#define CDGCACHE_H
+
+#include <QObject>
+#include <QStringList>
+#include <QByteArray>
+#include <QMutex>
+#include <QFuture>
+#include <QAtomicInt>
+#include <QHash>
+#include "libCDG/include/libCDG.h"
+
+class SongPrefetcher;
+
+// Cache of decoded cdg timelines, stored on disk and keyed by a hash of the cdg data.  Files are in libCDG's
+// timeline format and are memory mapped when loaded.  The cache is capped at Settings::cdgCacheMaxSize() megabytes,
+// least recently used entries are removed first.
+
+class CdgCache : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CdgCache(QObject *parent = 0);
+    ~CdgCache();
+    // Karaoke files are read from the prefetcher's local copy when it has one
+    void setPrefetcher(SongPrefetcher *prefetcher);
+    // Opens cdgData in cdg, from the cache if possible.  On a miss the data is streamed (stream = true) and decoded
+    // for the cache in the background, or processed and stored right away.
+    bool open(CDG *cdg, const QByteArray &cdgData, bool stream);
+    bool load(CDG *cdg, const QByteArray &cdgData);
+    void store(CDG *cdg, const QByteArray &cdgData);
+    // Reads and processes a karaoke file (zip or cdg) into cdg.  Safe to call from a worker thread, as long as nothing
+    // else is using cdg until it returns.
+    bool openFile(CDG *cdg, QString karaokeFilePath);
+    bool contains(const QByteArray &cdgData);
+    // Decode the given karaoke files (zip or cdg) in the background so they're cached before they're played.
+    // Replaces any files still waiting from a previous call.
+    void warmUp(QStringList files);
+    static QByteArray readCdgData(QString karaokeFilePath);
+
+public slots:
+    void setMaxSize(int megabytes);
+
+private:
+    QString cacheDir;
+    QMutex mutex;
+    QStringList pendingFiles;
+    QList<QByteArray> pendingData;
+    QFuture<void> worker;
+    // Whether processPending() is still going to look at the queues, guarded by mutex
+    bool workerActive;
+    QAtomicInt stopping;
+    SongPrefetcher *prefetcher;
+    QStringList warmList;
+    // Cache file of each karaoke file read so far, valid while the karaoke file's mtime and size don't change.  Guarded
+    // by mutex.
+    struct KnownFile
+    {
+        qint64 mtime;
+        qint64 size;
+        QString cacheFile;
+    };
+    QHash<QString, KnownFile> knownFiles;
+    bool loadFile(CDG *cdg, const QString &fileName);
+    QString localFile(QString karaokeFilePath);
+    QString knownCacheFile(QString fileName);
+    void remember(QString fileName, QString timelineFile);
+    // Copy of Settings::cdgCacheMaxSize(), the settings object can't be used from the worker threads
+    QAtomicInt maxSize;
+    QString cacheFile(const QByteArray &cdgData);
+    void storeTimeline(const QString &fileName, const QByteArray &timeline);
+    void evict();
+    void processPending();
+};
+
+#endif // CDGCACHE_H
@@ -66,6 +66,7 @@ bool CdgVideoSurface::start()
 void CdgVideoSurface::stop()
 {
     currentFrame = QVideoFrame();
+    currentImage = QImage();
     targetRect = QRect();
     QAbstractVideoSurface::stop();
     widget->repaint();
@@ -73,6 +74,11 @@ void CdgVideoSurface::stop()
 
 bool CdgVideoSurface::present(const QVideoFrame &frame)
 {
+    if (!currentImage.isNull())
+    {
+        currentImage = QImage();
+        sourceRect = surfaceFormat().viewport();
+    }
     if (surfaceFormat().pixelFormat() != frame.pixelFormat() || surfaceFormat().frameSize() != frame.size()) {
         stop();
         start(QVideoSurfaceFormat(frame.size(), frame.pixelFormat()));
@@ -86,6 +92,52 @@ bool CdgVideoSurface::present(const QVideoFrame &frame)
     }
 }
 
+bool CdgVideoSurface::presentCdgFrame(const CDG_Frame_Handle &frame, bool fullRepaint)
+{
+    // The frame is shown straight from libCDG's buffer.  Indexed frames skip palette expansion entirely, a palette
+    // change just swaps the colour table.  Only the part of the widget covering the changed area is repainted.
+    if (frame.data == NULL)
+        return false;
+    if (!isActive())
+        start();
+    QImage::Format format = (frame.indexed) ? QImage::Format_Indexed8 : QImage::Format_RGB888;
+    if ((currentImage.isNull()) || (currentImage.format() != format) || (currentImage.size() != QSize(frame.width, frame.height)))
+        fullRepaint = true;
+    if ((!frame.changed) && (!fullRepaint))
+        return true;
+    if ((frame.paletteChanged) || (fullRepaint))
+    {
+        if (cdgColorTable.size() != 16)
+            cdgColorTable.resize(16);
+        for (int i=0; i < 16; i++)
+        {
+            if (cdgColorTable.at(i) != frame.colorTable[i])
+                cdgColorTable[i] = frame.colorTable[i];
+        }
+    }
+    currentFrame = QVideoFrame();
+    currentImage = QImage(const_cast<uchar *>(frame.data), frame.width, frame.height, frame.bytesPerLine, format);
+    if (frame.indexed)
+        currentImage.setColorTable(cdgColorTable);
+    sourceRect = currentImage.rect();
+    if (fullRepaint)
+        widget->repaint(targetRect);
+    else if ((frame.dirty.width > 0) && (frame.dirty.height > 0))
+        widget->repaint(mapToWidget(QRect(frame.dirty.x, frame.dirty.y, frame.dirty.width, frame.dirty.height)));
+    return true;
+}
+
+QRect CdgVideoSurface::mapToWidget(const QRect &frameRect) const
+{
+    if (sourceRect.isEmpty())
+        return targetRect;
+    qreal sx = (qreal)targetRect.width() / sourceRect.width();
+    qreal sy = (qreal)targetRect.height() / sourceRect.height();
+    QRectF mapped(targetRect.x() + (frameRect.x() - sourceRect.x()) * sx, targetRect.y() + (frameRect.y() - sourceRect.y()) * sy, frameRect.width() * sx, frameRect.height() * sy);
+    // pad by a pixel so rounding in the scaled draw can't leave a stale edge
+    return mapped.toAlignedRect().adjusted(-1, -1, 1, 1) & targetRect;
+}
+
 void CdgVideoSurface::updateVideoRect()
 {
     QSize size = surfaceFormat().sizeHint();
@@ -95,24 +147,55 @@ void CdgVideoSurface::updateVideoRect()
     targetRect.moveCenter(widget->rect().center());
 }
 
-void CdgVideoSurface::paint(QPainter *painter)
+void CdgVideoSurface::paint(QPainter *painter, const QRect &exposedRect)
 {
-    if (currentFrame.map(QAbstractVideoBuffer::ReadOnly)) {
+    if (!currentImage.isNull())
+    {
+        painter->setRenderHint(QPainter::Antialiasing);
+        drawImage(painter, currentImage, exposedRect);
+    }
+    else if (currentFrame.map(QAbstractVideoBuffer::ReadOnly)) {
         const QTransform oldTransform = painter->transform();
         painter->setRenderHint(QPainter::Antialiasing);
         if (surfaceFormat().scanLineDirection() == QVideoSurfaceFormat::BottomToTop) {
            painter->scale(1, -1);
            painter->translate(0, -widget->height());
+           painter->drawImage(targetRect, QImage(currentFrame.bits(), currentFrame.width(), currentFrame.height(), currentFrame.bytesPerLine(), imageFormat), sourceRect);
+        }
+        else
+        {
+            QImage image(currentFrame.bits(), currentFrame.width(), currentFrame.height(), currentFrame.bytesPerLine(), imageFormat);
+            drawImage(painter, image, exposedRect);
         }
-        QImage image(currentFrame.bits(), currentFrame.width(), currentFrame.height(), currentFrame.bytesPerLine(), imageFormat);
-        painter->drawImage(targetRect, image, sourceRect);
         painter->setTransform(oldTransform);
         currentFrame.unmap();
     }
 }
 
+void CdgVideoSurface::drawImage(QPainter *painter, const QImage &image, const QRect &exposedRect)
+{
+    if ((exposedRect.isValid()) && (!exposedRect.contains(targetRect)) && (!sourceRect.isEmpty()))
+    {
+        // Partial repaint, only scale the part of the frame under the exposed area
+        qreal sx = (qreal)targetRect.width() / sourceRect.width();
+        qreal sy = (qreal)targetRect.height() / sourceRect.height();
+        QRectF exposedSource(sourceRect.x() + (exposedRect.x() - targetRect.x()) / sx, sourceRect.y() + (exposedRect.y() - targetRect.y()) / sy, exposedRect.width() / sx, exposedRect.height() / sy);
+        QRect source = exposedSource.toAlignedRect() & sourceRect;
+        QRectF target(targetRect.x() + (source.x() - sourceRect.x()) * sx, targetRect.y() + (source.y() - sourceRect.y()) * sy, source.width() * sx, source.height() * sy);
+        painter->drawImage(target, image, source);
+    }
+    else
+        painter->drawImage(targetRect, image, sourceRect);
+}
+
 void CdgVideoSurface::blankImage()
 {
     QVideoFrame frame;
     present(frame);
 }
+
+void CdgVideoSurface::detachCdgFrame()
+{
+    if (!currentImage.isNull())
+        currentImage = currentImage.copy();
+}
@@ -1,6 +1,8 @@
 #ifndef CDGVIDEOSURFACE_H
 #define CDGVIDEOSURFACE_H
 #include <QAbstractVideoSurface>
+#include <QVector>
+#include "libCDG/include/libCDG.h"
 
 
 class CdgVideoSurface : public QAbstractVideoSurface
@@ -16,10 +18,13 @@ public:
     bool start();
     void stop();
     bool present(const QVideoFrame &frame);
+    bool presentCdgFrame(const CDG_Frame_Handle &frame, bool fullRepaint = false);
     void updateVideoRect();
     QRect videoRect() const { return targetRect; }
-    void paint(QPainter *painter);
+    void paint(QPainter *painter, const QRect &exposedRect = QRect());
     void blankImage();
+    // Copy the shown cdg frame out of libCDG's buffer, call before the CDG that owns it is closed or deleted
+    void detachCdgFrame();
 
 private:
     QWidget *widget;
@@ -28,6 +33,10 @@ private:
     QSize imageSize;
     QRect sourceRect;
     QVideoFrame currentFrame;
+    QImage currentImage;
+    QVector<QRgb> cdgColorTable;
+    QRect mapToWidget(const QRect &frameRect) const;
+    void drawImage(QPainter *painter, const QImage &image, const QRect &exposedRect);
 };
 
 #endif // CDGVIDEOSURFACE_H
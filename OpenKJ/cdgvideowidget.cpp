@@ -98,7 +98,7 @@ void CdgVideoWidget::paintEvent(QPaintEvent *event)
                 painter.fillRect(rect, brush);
         }
 
-        surface->paint(&painter);
+        surface->paint(&painter, event->rect());
     } else {
         painter.fillRect(event->rect(), palette().background());
     }
@@ -157,6 +157,15 @@ void DbTableModel::refreshCache()
     search(lastSearch);
 }
 
+void DbTableModel::refreshSearch()
+{
+    // The update thread writes through its own connection, the songs it committed so far are copied into the cache here.
+    // Moved songs keep their old path in the cache until the refreshCache() at the end of the update.
+    QSqlQuery query(db);
+    query.exec("INSERT INTO mem.dbsongs SELECT * FROM main.dbsongs WHERE songid > (SELECT IFNULL(MAX(songid), 0) FROM mem.dbsongs)");
+    search(lastSearch);
+}
+
 
 //QVariant DbTableModel::headerData(int section, Qt::Orientation orientation, int role) const
 //{
@@ -47,6 +47,10 @@ public:
     void sort(int column, Qt::SortOrder order);
     void refreshCache();
 
+public slots:
+    // Runs the current search again, for rows added to mem.dbsongs by a scan that is still going
+    void refreshSearch();
+
 protected:
     QString orderByClause() const;
 
@@ -23,19 +23,32 @@
 #include <QFileInfo>
 #include <QDir>
 #include <QDirIterator>
+#include <QSet>
+#include <QHash>
+#include <QDateTime>
+#include <QThreadPool>
+#include <QQueue>
+#include <QElapsedTimer>
 #include <QDebug>
 #include <QStandardPaths>
+#include <QCryptographicHash>
 #include "sourcedirtablemodel.h"
 #include <QtConcurrent>
 #include "okarchive.h"
 #include "tagreader.h"
 #include "karaokefileinfo.h"
+#include "siblingindex.h"
 
-SourceDir::NamingPattern g_pattern;
-int g_customPatternId, g_artistCaptureGrp, g_titleCaptureGrp, g_songIdCaptureGrp;
-QString g_artistRegex, g_titleRegex, g_songIdRegex;
 QStringList errors;
 
+#define SCAN_BATCH_SIZE 2000
+// Files handed to the pool but not written yet
+#define SCAN_QUEUE_LIMIT 256
+// Longest a validated song waits before it's committed and becomes searchable, in ms
+#define SCAN_COMMIT_INTERVAL 3000
+// Bytes hashed from each end of a file for its fingerprint
+#define FINGERPRINT_CHUNK 4096
+
 bool DbUpdateThread::dbEntryExists(QString filepath)
 {
     QSqlQuery query;
@@ -50,7 +63,7 @@ DbUpdateThread::DbUpdateThread(QObject *parent) :
     QThread(parent)
 {
     pattern = SourceDir::SAT;
-    g_pattern = pattern;
+    dbFileName = QSqlDatabase::database().databaseName();
 }
 
 int DbUpdateThread::getPattern() const
@@ -61,7 +74,11 @@ int DbUpdateThread::getPattern() const
 void DbUpdateThread::setPattern(SourceDir::NamingPattern value)
 {
     pattern = value;
-    g_pattern = value;
+}
+
+void DbUpdateThread::setSourceDirs(QList<SourceDir> dirs)
+{
+    sourceDirs = dirs;
 }
 
 QString DbUpdateThread::getPath() const
@@ -69,69 +86,150 @@ QString DbUpdateThread::getPath() const
     return path;
 }
 
-QStringList DbUpdateThread::findKaraokeFiles(QString directory)
+void DbUpdateThread::findKaraokeFiles(QList<SourceDir> dirs)
 {
-    QStringList files;
-    emit progressMessage("Finding karaoke files in " + directory);
-    files.clear();
-    QDir dir(directory);
-    QDirIterator iterator(dir.absolutePath(), QDirIterator::Subdirectories);
+    missingInTree.clear();
+    newSnapshots.clear();
+    removedDirs.clear();
+    QStringList roots;
+    for (int i=0; i < dirs.size(); i++)
+    {
+        roots.append(QDir(dirs.at(i).getPath()).absolutePath());
+        emit progressMessage("Finding karaoke files in " + roots.last());
+    }
+    scanRoots = roots;
     int existing = 0;
     int notInDb = 0;
     int total = 0;
-    QSqlQuery query;
-    bool alreadyInDb = false;
-    query.prepare("SELECT songid FROM mem.dbsongs WHERE path = :filepath AND discid != '!!DROPPED!!' LIMIT 1");
-    while (iterator.hasNext()) {
-        iterator.next();
-        if (!iterator.fileInfo().isDir()) {
+    int skippedDirs = 0;
+    int skippedEntries = 0;
+    // Load the known paths up front, the walk then never has to go to the database
+    QSet<QString> knownPaths;
+    QHash<QString, QStringList> knownByDir;
+    QSqlQuery query(db);
+    query.exec("SELECT path, discid FROM dbsongs");
+    while (query.next())
+    {
+        QString songPath = query.value(0).toString();
+        if (query.value(1).toString() != "!!DROPPED!!")
+            knownPaths.insert(songPath);
+        // Songs with a fingerprint are recognized by their content, only the rest need matching by name
+        if (!fingerprintedPaths.contains(songPath))
+            knownFileNames.insert(songPath.mid(songPath.lastIndexOf('/') + 1));
+        knownByDir[songPath.left(songPath.lastIndexOf('/'))].append(songPath);
+    }
+    // Snapshots of the directories under the source dirs from the last scan
+    QHash<QString, DirSnapshot> snapshots;
+    query.exec("SELECT path, mtime, entries, inode, scanned FROM dirSnapshots");
+    while (query.next())
+    {
+        QString dirPath = query.value(0).toString();
+        bool inRoots = false;
+        for (int i=0; (i < roots.size()) && (!inRoots); i++)
+            inRoots = ((dirPath == roots.at(i)) || (dirPath.startsWith(roots.at(i) + "/")));
+        if (!inRoots)
+            continue;
+        DirSnapshot snapshot;
+        snapshot.mtime = query.value(1).toLongLong();
+        snapshot.entries = query.value(2).toInt();
+        snapshot.inode = query.value(3).toLongLong();
+        snapshot.scanned = query.value(4).toLongLong();
+        snapshots.insert(dirPath, snapshot);
+    }
+    DirWalker walker;
+    walker.setSnapshots(snapshots);
+    walker.start(roots);
+    DirListing listing;
+    while (walker.next(listing))
+    {
+        // Write out whatever the pool has finished with while the walk carries on
+        writeResults(false);
+        snapshots.remove(listing.path);
+        if (!listing.listed)
+        {
+            skippedDirs++;
+            skippedEntries += listing.state.entries;
+            continue;
+        }
+        newSnapshots.insert(listing.path, listing.state);
+        // Index the directory by name, with the extension's case ignored, so cdg files are matched up with their mp3
+        // without going back to the disk
+        QSet<QString> siblings;
+        for (int i=0; i < listing.files.size(); i++)
+            siblings.insert(SiblingIndex::key(listing.files.at(i)));
+        QSet<QString> present;
+        for (int i=0; i < listing.files.size(); i++)
+        {
+            QString fn = listing.files.at(i);
+            present.insert(fn);
             total++;
-            query.bindValue(":filepath", iterator.filePath());
-            query.exec();
-            if (query.first())
-            {
-                alreadyInDb = true;
-            }
-            else
-            {
-                alreadyInDb = false;
-            }
-            if (alreadyInDb)
+            if (total % 250 == 0)
+                emit stateChanged("Finding potential karaoke files... " + QString::number(total) + " found. " + QString::number(notInDb) + " new/" + QString::number(existing) + " existing");
+            if (knownPaths.contains(fn))
             {
                 existing++;
-                emit stateChanged("Finding potential karaoke files... " + QString::number(total) + " found. " + QString::number(notInDb) + " new/" + QString::number(existing) + " existing");
                 continue;
             }
-            QString fn = iterator.filePath();
             if (fn.endsWith(".zip",Qt::CaseInsensitive))
-                files.append(fn);
+                queueCandidate(fn, listing.root);
             else if (fn.endsWith(".cdg", Qt::CaseInsensitive))
             {
                 QString mp3filename = fn;
                 mp3filename.chop(3);
-                if ((QFile::exists(mp3filename + "mp3")) || (QFile::exists(mp3filename + "MP3")) || (QFile::exists(mp3filename + "Mp3")) || (QFile::exists(mp3filename + "mP3")))
-                    files.append(fn);
+                if (siblings.contains(SiblingIndex::key(mp3filename + "mp3")))
+                    queueCandidate(fn, listing.root);
             }
             else if (fn.endsWith(".mkv", Qt::CaseInsensitive) || fn.endsWith(".avi", Qt::CaseInsensitive) || fn.endsWith(".wmv", Qt::CaseInsensitive) || fn.endsWith(".mp4", Qt::CaseInsensitive) || fn.endsWith(".mpg", Qt::CaseInsensitive) || fn.endsWith(".mpeg", Qt::CaseInsensitive))
-                files.append(fn);
+                queueCandidate(fn, listing.root);
             notInDb++;
         }
-        emit stateChanged("Finding potential karaoke files... " + QString::number(total) + " found. " + QString::number(notInDb) + " new/" + QString::number(existing) + " existing");
-
-        //emit stateChanged("Finding potential karaoke files... " + QString::number(files.size()) + " found.");
+        // Songs this directory used to hold
+        QStringList known = knownByDir.value(listing.path);
+        for (int i=0; i < known.size(); i++)
+        {
+            if (!present.contains(known.at(i)))
+                missingInTree.append(known.at(i));
+        }
     }
+    // Whatever is left wasn't reached, the directory is gone along with its songs
+    QHash<QString, DirSnapshot>::const_iterator it;
+    for (it = snapshots.constBegin(); it != snapshots.constEnd(); ++it)
+    {
+        removedDirs.append(it.key());
+        missingInTree.append(knownByDir.value(it.key()));
+    }
+    emit stateChanged("Finding potential karaoke files... " + QString::number(total) + " found. " + QString::number(notInDb) + " new/" + QString::number(existing) + " existing");
+    qWarning() << "DbUpdateThread - " << roots << ": " << newSnapshots.size() << " directories listed, " << skippedDirs << " unchanged (" << skippedEntries << " entries skipped), " << removedDirs.size() << " removed";
     emit progressMessage("Done searching for files.");
-    return files;
 }
 
 QStringList DbUpdateThread::getMissingDbFiles()
 {
-    QStringList files;
-    QSqlQuery query;
-    query.exec("SELECT path from mem.dbsongs");
+    // Songs under a snapshotted directory of the roots just walked were accounted for by the walk, only the rest still
+    // need checking on disk.  Other source dirs weren't walked, their snapshots say nothing about this scan.
+    QStringList files = missingInTree;
+    QSet<QString> snapshotDirs;
+    QSqlQuery query(db);
+    query.exec("SELECT path FROM dirSnapshots");
+    while (query.next())
+    {
+        QString dirPath = query.value(0).toString();
+        for (int i=0; i < scanRoots.size(); i++)
+        {
+            if ((dirPath == scanRoots.at(i)) || (dirPath.startsWith(scanRoots.at(i) + "/")))
+            {
+                snapshotDirs.insert(dirPath);
+                break;
+            }
+        }
+    }
+    query.exec("SELECT path from dbsongs");
     while (query.next())
     {
         QString path = query.value("path").toString();
+        QString dirPath = path.left(path.lastIndexOf('/'));
+        if ((snapshotDirs.contains(dirPath)) || (newSnapshots.contains(dirPath)))
+            continue;
         if (!QFile(path).exists())
         {
             files.append(path);
@@ -140,11 +238,40 @@ QStringList DbUpdateThread::getMissingDbFiles()
     return files;
 }
 
+void DbUpdateThread::saveDirSnapshots()
+{
+    QSqlQuery query(db);
+    query.exec("BEGIN TRANSACTION");
+    query.prepare("DELETE FROM dirSnapshots WHERE path = :path");
+    for (int i=0; i < removedDirs.size(); i++)
+    {
+        query.bindValue(":path", removedDirs.at(i));
+        query.exec();
+    }
+    query.prepare("INSERT OR REPLACE INTO dirSnapshots (path, mtime, entries, inode, scanned) VALUES(:path, :mtime, :entries, :inode, :scanned)");
+    QHash<QString, DirSnapshot>::const_iterator it;
+    for (it = newSnapshots.constBegin(); it != newSnapshots.constEnd(); ++it)
+    {
+        query.bindValue(":path", it.key());
+        query.bindValue(":mtime", it.value().mtime);
+        query.bindValue(":entries", it.value().entries);
+        query.bindValue(":inode", it.value().inode);
+        // A directory holding a file that failed validation is listed again next time, the file may have been half
+        // copied.  It keeps its row though, an unchanged parent only walks into the subdirectories it has snapshots of.
+        query.bindValue(":scanned", (failedDirs.contains(it.key())) ? 0 : it.value().scanned);
+        query.exec();
+    }
+    query.exec("COMMIT TRANSACTION");
+    newSnapshots.clear();
+    removedDirs.clear();
+    failedDirs.clear();
+}
+
 QStringList DbUpdateThread::getDragDropFiles()
 {
     QStringList files;
-    QSqlQuery query;
-    query.exec("SELECT path from mem.dbsongs WHERE discid = '!!DROPPED!!'");
+    QSqlQuery query(db);
+    query.exec("SELECT path from dbsongs WHERE discid = '!!DROPPED!!'");
     while (query.next())
     {
         files.append(query.value("path").toString());
@@ -230,196 +357,410 @@ void DbUpdateThread::setPath(const QString &value)
 
 }
 
-void DbUpdateThread::run()
+ScanPattern DbUpdateThread::loadPattern(SourceDir dir)
 {
-    emit progressChanged(0);
-    emit progressMaxChanged(0);
-    emit stateChanged("Verifing that files in DB are present on disk");
-    emit stateChanged("Finding potential karaoke files...");
-    QStringList missingFiles = getMissingDbFiles();
-    QStringList newSongs = findKaraokeFiles(path);
-    QStringList dragDropFiles = getDragDropFiles();
-    QSqlQuery query;
+    ScanPattern scanPattern;
+    scanPattern.pattern = dir.getPattern();
+    scanPattern.customValid = false;
+    scanPattern.artistCaptureGrp = 0;
+    scanPattern.titleCaptureGrp = 0;
+    scanPattern.songIdCaptureGrp = 0;
+    if (scanPattern.pattern != SourceDir::CUSTOM)
+        return scanPattern;
+    QSqlQuery query(db);
+    query.prepare("SELECT custompatterns.* FROM custompatterns JOIN sourcedirs ON sourcedirs.custompattern = custompatterns.patternid WHERE sourcedirs.path = :path");
+    query.bindValue(":path", dir.getPath());
+    query.exec();
+    if (query.first())
+    {
+        scanPattern.customValid = true;
+        scanPattern.artistRegex = query.value("artistregex").toString();
+        scanPattern.artistCaptureGrp = query.value("artistcapturegrp").toInt();
+        scanPattern.titleRegex = query.value("titleregex").toString();
+        scanPattern.titleCaptureGrp = query.value("titlecapturegrp").toInt();
+        scanPattern.songIdRegex = query.value("discidregex").toString();
+        scanPattern.songIdCaptureGrp = query.value("discidcapturegrp").toInt();
+    }
+    else
+        qCritical() << "Custom pattern set for path, but pattern ID is invalid!";
+    return scanPattern;
+}
 
-    // Try to find out if any of the new files found have been moved and fix the db entry
-    emit stateChanged("Detecting and updating moved files...");
-    emit progressMaxChanged(missingFiles.size());
-    int count = 0;
-    query.exec("BEGIN TRANSACTION");
-    for (int f=0; f<missingFiles.size(); f++)
+static QString fileFingerprint(QString fileName)
+{
+    // Size plus a hash of both ends of the file.  That's enough to tell songs apart without reading whole files and it
+    // survives both moves and renames.
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QString();
+    qint64 size = file.size();
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(file.read(FINGERPRINT_CHUNK));
+    if (size > FINGERPRINT_CHUNK)
     {
-        emit progressMessage("Looking for matches to missing db song: " + missingFiles.at(f));
-        qWarning() << "Looking for match for missing file: " << missingFiles.at(f);
-        bool matchfound = false;
-        for (int i=0; i < newSongs.size(); i++)
+        file.seek(qMax(size - FINGERPRINT_CHUNK, (qint64)FINGERPRINT_CHUNK));
+        hash.addData(file.read(FINGERPRINT_CHUNK));
+    }
+    file.close();
+    return QString::number(size) + ":" + hash.result().toHex();
+}
+
+// Runs on the thread pool, must not touch the database or the DbUpdateThread
+static ScanResult validateKaraokeFile(QString fileName, ScanPattern pattern)
+{
+    ScanResult result;
+    result.path = fileName;
+    result.valid = false;
+    result.duration = 0;
+#ifdef Q_OS_WIN
+    if (fileName.contains("*") || fileName.contains("?") || fileName.contains("<") || fileName.contains(">") || fileName.contains("|"))
+    {
+        result.error = "Illegal character in filename";
+        return result;
+    }
+#endif
+    if (fileName.endsWith(".zip", Qt::CaseInsensitive))
+    {
+        OkArchive archive(fileName);
+        if (!archive.isValidKaraokeFile())
         {
-            QString missingFile = missingFiles.at(f);
-            QString newFile = newSongs.at(i);
-            if (QFileInfo(newSongs.at(i)).fileName() == QFileInfo(missingFiles.at(f)).fileName())
-            {
-                query.prepare("UPDATE dbsongs SET path = :newpath WHERE path = :oldpath");
-                query.bindValue(":newpath", newFile);
-                query.bindValue(":oldpath", missingFile);
-                query.exec();
-                qWarning() << "Missing file found at new location";
-                qWarning() << "  old: " << missingFile;
-                qWarning() << "  new: " << newFile;
-                newSongs.removeAt(i);
-                emit progressMessage("Found match! Modifying existing song.");
-                matchfound = true;
-                break;
-            }
+            result.error = archive.getLastError();
+            return result;
+        }
+        result.duration = archive.getSongDuration();
+    }
+    KaraokeFileInfo parser;
+    parser.setFileName(fileName);
+    if (pattern.pattern == SourceDir::CUSTOM)
+    {
+        if (pattern.customValid)
+        {
+            parser.setArtistRegEx(pattern.artistRegex, pattern.artistCaptureGrp);
+            parser.setTitleRegEx(pattern.titleRegex, pattern.titleCaptureGrp);
+            parser.setSongIdRegEx(pattern.songIdRegex, pattern.songIdCaptureGrp);
         }
-        if (!matchfound)
-            emit progressMessage("No match found");
+    }
+    else
+        parser.setPattern(pattern.pattern);
+    result.artist = parser.getArtist();
+    result.title = parser.getTitle();
+    result.discid = parser.getSongId();
+    if (!fileName.endsWith(".zip", Qt::CaseInsensitive))
+        result.duration = parser.getDuration();
+
+    if (result.artist == "" && result.title == "" && result.discid == "")
+    {
+        // Something went wrong, no metadata found. File is probably named wrong. If we didn't try media tags, give it a shot
+        if (pattern.pattern != SourceDir::METADATA)
+        {
+            parser.setPattern(SourceDir::METADATA);
+            result.artist = parser.getArtist();
+            result.title = parser.getTitle();
+            result.discid = parser.getSongId();
+        }
+        // If we still don't have any metadata, just throw filename into the title field
+        if (result.artist == "" && result.title == "" && result.discid == "")
+            result.title = QFileInfo(fileName).completeBaseName();
+    }
+    result.fingerprint = fileFingerprint(fileName);
+    result.valid = true;
+    return result;
+}
 
-        count++;
-        emit progressChanged(count);
+void DbUpdateThread::queueCandidate(QString fileName, int sourceDir, bool allowDefer)
+{
+    // A file sharing its name with a song already in the database may be that song after a move.  Those wait until
+    // the walk is done and the missing songs are known.
+    if ((allowDefer) && (!droppedPaths.contains(fileName)) && (knownFileNames.contains(fileName.mid(fileName.lastIndexOf('/') + 1))))
+    {
+        deferredFiles.insert(fileName, sourceDir);
+        return;
     }
-    query.exec("COMMIT TRANSACTION");
+    pendingResults.enqueue(QtConcurrent::run(&scanPool, validateKaraokeFile, fileName, scanPatterns.at(sourceDir)));
+    candidates++;
+    writeResults(false);
+}
 
-    for (int f=0; f < dragDropFiles.size(); f++)
+void DbUpdateThread::writeResults(bool waitForAll)
+{
+    // Results are taken in scan order.  Once the queue is full the walk waits here for the pool to catch up, which is
+    // what keeps memory flat no matter how big the library is.
+    while (!pendingResults.isEmpty())
     {
-        QString dropFile = dragDropFiles.at(f);
-        qWarning() << "Looking for matches for drop file: " << dropFile;
-        for (int i=0; i < newSongs.size(); i++)
+        if ((!waitForAll) && (!pendingResults.head().isFinished()) && (pendingResults.size() < SCAN_QUEUE_LIMIT))
+            break;
+        ScanResult result = pendingResults.dequeue().result();
+        processed++;
+        if (result.valid)
+            resultBuffer.append(result);
+        else
         {
-            if (newSongs.at(i) == dropFile)
-            {
-                qWarning() << "Found match for drop file: " << dropFile;
-                QFileInfo file(dropFile);
-                int duration = 0;
-                query.prepare("UPDATE dbsongs SET discid = :discid, artist = :artist, title = :title, filename = :filename, duration = :duration, searchstring = :searchstring WHERE path = :path");
-                QString artist;
-                QString title;
-                QString discid;
-                KaraokeFileInfo parser;
-                parser.setFileName(dropFile);
-                parser.setPattern(g_pattern, path);
-                artist = parser.getArtist();
-                title = parser.getTitle();
-                discid = parser.getSongId();
-                duration = parser.getDuration();
-
-                if (artist == "" && title == "" && discid == "")
-                {
-                    // Something went wrong, no metadata found. File is probably named wrong. If we didn't try media tags, give it a shot
-                    if (g_pattern != SourceDir::METADATA)
-                    {
-                        parser.setPattern(SourceDir::METADATA, path);
-                        artist = parser.getArtist();
-                        title = parser.getTitle();
-                        discid = parser.getSongId();
-                    }
-                    // If we still don't have any metadata, just throw filename into the title field
-                    if (artist == "" && title == "" && discid == "")
-                        title = file.completeBaseName();
-                }
-                query.bindValue(":discid", discid);
-                query.bindValue(":artist", artist);
-                query.bindValue(":title", title);
-                query.bindValue(":path", file.filePath());
-                query.bindValue(":filename", file.completeBaseName());
-                query.bindValue(":duration", duration);
-                query.bindValue(":searchstring", QString(file.completeBaseName() + " " + artist + " " + title + " " + discid));
-                query.exec();
-                newSongs.removeAt(i);
-                break;
-            }
+            errorMutex.lock();
+            errors.append(result.error + ": " + result.path);
+            errorMutex.unlock();
+            failedDirs.insert(result.path.left(result.path.lastIndexOf('/')));
+            emit progressMessage(result.error + ": " + result.path);
         }
+        emit stateChanged("Validating karaoke files and getting song durations... " + QString::number(processed) + " of " + QString::number(candidates));
     }
+    if ((resultBuffer.size() >= SCAN_BATCH_SIZE) || ((!resultBuffer.isEmpty()) && ((waitForAll) || (commitTimer.elapsed() >= SCAN_COMMIT_INTERVAL))))
+        commitResults();
+}
 
-    // Add new songs to the database
-    emit progressMaxChanged(newSongs.size());
-    emit progressMessage("Found " + QString::number(newSongs.size()) + " potential karaoke files.");
-    QString fileName;
+void DbUpdateThread::commitResults()
+{
+    QSqlQuery query(db);
     query.exec("BEGIN TRANSACTION");
-    emit progressMessage("Checking if files are valid and getting durations...");
-    emit stateChanged("Validating karaoke files and getting song durations...");
-    query.prepare("INSERT OR IGNORE INTO dbSongs (discid,artist,title,path,filename,duration,searchstring) VALUES(:discid, :artist, :title, :path, :filename, :duration, :searchstring)");
-    QProcess *process = new QProcess(this);
-    OkArchive *archive = new OkArchive(this);
-    for (int i=0; i < newSongs.count(); i++)
+    QSqlQuery insertQuery(db);
+    insertQuery.prepare("INSERT OR IGNORE INTO dbSongs (discid,artist,title,path,filename,duration,searchstring) VALUES(:discid, :artist, :title, :path, :filename, :duration, :searchstring)");
+    QSqlQuery dropQuery(db);
+    dropQuery.prepare("UPDATE dbsongs SET discid = :discid, artist = :artist, title = :title, filename = :filename, duration = :duration, searchstring = :searchstring WHERE path = :path");
+    QSqlQuery moveQuery(db);
+    moveQuery.prepare("UPDATE dbsongs SET path = :path, discid = :discid, artist = :artist, title = :title, filename = :filename, duration = :duration, searchstring = :searchstring WHERE path = :oldpath");
+    QSqlQuery fingerprintQuery(db);
+    fingerprintQuery.prepare("INSERT OR REPLACE INTO songFingerprints (songid, fingerprint) SELECT songid, :fingerprint FROM dbsongs WHERE path = :path");
+    for (int i=0; i < resultBuffer.size(); i++)
     {
-        fileName = newSongs.at(i);
-        int duration = 0;
-        QFileInfo file(fileName);
-        //emit progressMessage("Processing file: " + file.fileName());
-#ifdef Q_OS_WIN
-        if (fileName.contains("*") || fileName.contains("?") || fileName.contains("<") || fileName.contains(">") || fileName.contains("|"))
+        const ScanResult &result = resultBuffer.at(i);
+        QFileInfo file(result.path);
+        QString oldPath;
+        if (!droppedPaths.contains(result.path))
+            oldPath = movedFrom(result);
+        // Dropped files already have a row, it just gets the real metadata.  Moved songs keep their row and song id.
+        QSqlQuery &target = (!oldPath.isEmpty()) ? moveQuery : (droppedPaths.contains(result.path)) ? dropQuery : insertQuery;
+        target.bindValue(":discid", result.discid);
+        target.bindValue(":artist", result.artist);
+        target.bindValue(":title", result.title);
+        target.bindValue(":path", file.filePath());
+        target.bindValue(":filename", file.completeBaseName());
+        target.bindValue(":duration", result.duration);
+        target.bindValue(":searchstring", QString(file.completeBaseName() + " " + result.artist + " " + result.title + " " + result.discid));
+        if (!oldPath.isEmpty())
         {
-            // illegal character
-            errorMutex.lock();
-            errors.append("Illegal character in filename: " + fileName);
-            errorMutex.unlock();
-            emit progressMessage("Illegal character in filename: " + fileName);
-            emit progressChanged(i + 1);
-            continue;
+            target.bindValue(":oldpath", oldPath);
+            movedPaths.insert(oldPath);
+            qWarning() << "Song moved, matched by fingerprint";
+            qWarning() << "  old: " << oldPath;
+            qWarning() << "  new: " << file.filePath();
+            emit progressMessage("Found match for missing db song! Modifying existing song: " + file.filePath());
         }
-#endif
-        if (fileName.endsWith(".zip", Qt::CaseInsensitive))
+        target.exec();
+        if (!result.fingerprint.isEmpty())
         {
-            //OkArchive *archive = new OkArchive(process);
-            archive->setArchiveFile(fileName);
-
-            if (!archive->isValidKaraokeFile())
-            {
-                errorMutex.lock();
-                errors.append(archive->getLastError() + ": " + fileName);
-                errorMutex.unlock();
-                emit progressMessage(archive->getLastError() + ": " + fileName);
-                emit progressChanged(i + 1);
-                continue;
-            }
-
-            duration = archive->getSongDuration();
+            fingerprintQuery.bindValue(":fingerprint", result.fingerprint);
+            fingerprintQuery.bindValue(":path", file.filePath());
+            fingerprintQuery.exec();
         }
+    }
+    query.exec("COMMIT TRANSACTION");
+    resultBuffer.clear();
+    commitTimer.restart();
+    emit songsAdded();
+}
 
-        QString artist;
-        QString title;
-        QString discid;
+void DbUpdateThread::loadFingerprints()
+{
+    fingerprints.clear();
+    fingerprintedPaths.clear();
+    movedPaths.clear();
+    QSqlQuery query(db);
+    query.exec("SELECT dbsongs.path, songFingerprints.fingerprint FROM dbsongs INNER JOIN songFingerprints ON dbsongs.songid = songFingerprints.songid WHERE dbsongs.discid != '!!DROPPED!!'");
+    while (query.next())
+    {
+        fingerprints.insert(query.value(1).toString(), query.value(0).toString());
+        fingerprintedPaths.insert(query.value(0).toString());
+    }
+}
 
-        KaraokeFileInfo parser;
-        parser.setFileName(fileName);
+QString DbUpdateThread::movedFrom(const ScanResult &result)
+{
+    // A known fingerprint under another path is the same song, as long as the file isn't still at the old path
+    if (result.fingerprint.isEmpty())
+        return QString();
+    QStringList paths = fingerprints.values(result.fingerprint);
+    for (int i=0; i < paths.size(); i++)
+    {
+        if ((paths.at(i) != result.path) && (!movedPaths.contains(paths.at(i))) && (!QFile::exists(paths.at(i))))
+            return paths.at(i);
+    }
+    return QString();
+}
 
-        parser.setPattern(g_pattern, path);
-        artist = parser.getArtist();
-        title = parser.getTitle();
-        discid = parser.getSongId();
-        if (!fileName.endsWith(".zip", Qt::CaseInsensitive))
-            duration = parser.getDuration();
+void DbUpdateThread::backfillFingerprints(QStringList roots, QSet<QString> missingFiles)
+{
+    // Songs added before fingerprints existed, or through a drop, get theirs here so a later move can be recognized.
+    // Only songs under the dirs just scanned, and not the ones known to be missing, each one is a file open.
+    QSqlQuery query(db);
+    query.exec("DELETE FROM songFingerprints WHERE songid NOT IN (SELECT songid FROM dbsongs)");
+    QList<int> songIds;
+    QStringList paths;
+    query.exec("SELECT songid, path FROM dbsongs WHERE songid NOT IN (SELECT songid FROM songFingerprints)");
+    while (query.next())
+    {
+        QString songPath = query.value(1).toString();
+        if (missingFiles.contains(songPath))
+            continue;
+        bool inRoots = false;
+        for (int i=0; (i < roots.size()) && (!inRoots); i++)
+            inRoots = songPath.startsWith(roots.at(i) + "/");
+        if (!inRoots)
+            continue;
+        songIds.append(query.value(0).toInt());
+        paths.append(songPath);
+    }
+    if (paths.isEmpty())
+        return;
+    emit stateChanged("Fingerprinting existing songs...");
+    emit progressMaxChanged(paths.size());
+    QSqlQuery insertQuery(db);
+    insertQuery.prepare("INSERT OR REPLACE INTO songFingerprints (songid, fingerprint) VALUES(:songid, :fingerprint)");
+    for (int start=0; start < paths.size(); start += SCAN_BATCH_SIZE)
+    {
+        int end = qMin(start + SCAN_BATCH_SIZE, paths.size());
+        QList<QFuture<QString> > results;
+        for (int i=start; i < end; i++)
+            results.append(QtConcurrent::run(&scanPool, fileFingerprint, paths.at(i)));
+        // All the reads are done before the transaction starts, the write lock isn't held while waiting on the share
+        QStringList batch;
+        for (int i=0; i < results.size(); i++)
+            batch.append(results.at(i).result());
+        query.exec("BEGIN TRANSACTION");
+        for (int i=start; i < end; i++)
+        {
+            // Files that went away since the walk are left alone, they're tried again on the next scan
+            const QString &fingerprint = batch.at(i - start);
+            if (fingerprint.isEmpty())
+                continue;
+            insertQuery.bindValue(":songid", songIds.at(i));
+            insertQuery.bindValue(":fingerprint", fingerprint);
+            insertQuery.exec();
+        }
+        query.exec("COMMIT TRANSACTION");
+        emit progressChanged(end);
+    }
+    emit progressMaxChanged(0);
+}
 
-        if (artist == "" && title == "" && discid == "")
+void DbUpdateThread::reconcileMovedFiles(QStringList missingFiles)
+{
+    QHash<QString, QStringList> deferredByName;
+    QHash<QString, int>::const_iterator deferred;
+    for (deferred = deferredFiles.constBegin(); deferred != deferredFiles.constEnd(); ++deferred)
+        deferredByName[deferred.key().mid(deferred.key().lastIndexOf('/') + 1)].append(deferred.key());
+    emit progressMaxChanged(missingFiles.size());
+    QSqlQuery query(db);
+    query.exec("BEGIN TRANSACTION");
+    query.prepare("UPDATE dbsongs SET path = :newpath WHERE path = :oldpath");
+    for (int f=0; f < missingFiles.size(); f++)
+    {
+        QString missingFile = missingFiles.at(f);
+        // Already picked up by its fingerprint while the new files were written
+        if (movedPaths.contains(missingFile))
         {
-            // Something went wrong, no metadata found. File is probably named wrong. If we didn't try media tags, give it a shot
-            if (g_pattern != SourceDir::METADATA)
-            {
-                parser.setPattern(SourceDir::METADATA, path);
-                artist = parser.getArtist();
-                title = parser.getTitle();
-                discid = parser.getSongId();
-            }
-            // If we still don't have any metadata, just throw filename into the title field
-            if (artist == "" && title == "" && discid == "")
-                title = file.completeBaseName();
+            emit progressChanged(f + 1);
+            continue;
         }
+        qWarning() << "Looking for match for missing file: " << missingFile;
+        QStringList &matches = deferredByName[missingFile.mid(missingFile.lastIndexOf('/') + 1)];
+        if (matches.isEmpty())
+            emit progressMessage("No match found for missing db song: " + missingFile);
+        else
+        {
+            QString newFile = matches.takeFirst();
+            deferredFiles.remove(newFile);
+            query.bindValue(":newpath", newFile);
+            query.bindValue(":oldpath", missingFile);
+            query.exec();
+            qWarning() << "Missing file found at new location";
+            qWarning() << "  old: " << missingFile;
+            qWarning() << "  new: " << newFile;
+            emit progressMessage("Found match for missing db song! Modifying existing song: " + newFile);
+        }
+        emit progressChanged(f + 1);
+    }
+    query.exec("COMMIT TRANSACTION");
+}
 
-        query.bindValue(":discid", discid);
-        query.bindValue(":artist", artist);
-        query.bindValue(":title", title);
-        query.bindValue(":path", file.filePath());
-        query.bindValue(":filename", file.completeBaseName());
-        query.bindValue(":duration", duration);
-        query.bindValue(":searchstring", QString(file.completeBaseName() + " " + artist + " " + title + " " + discid));
-        query.exec();
-        emit progressChanged(i + 1);
-        emit stateChanged("Validating karaoke files and getting song durations... " + QString::number(i + 1) + " of " + QString::number(newSongs.size()));
-       // msleep(60);
+void DbUpdateThread::run()
+{
+    // Nothing to scan.  QDir("") would be the working directory.
+    if ((sourceDirs.isEmpty()) && (path.isEmpty()))
+        return;
+    // SQLite connections can't be shared between threads, the scan gets its own and the ui keeps the default one.  The
+    // in-memory song cache only exists on the default connection, the ui copies new songs into it on songsAdded().
+    QString connectionName = "dbupdate_" + QString::number((quintptr)this);
+    db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    db.setDatabaseName(dbFileName);
+    if (db.open())
+        scan();
+    else
+        qWarning() << "DbUpdateThread - Unable to open database " << dbFileName;
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
 
+void DbUpdateThread::scan()
+{
+    emit progressChanged(0);
+    emit progressMaxChanged(0);
+    emit stateChanged("Finding potential karaoke files...");
+    QList<SourceDir> dirs = sourceDirs;
+    if (dirs.isEmpty())
+    {
+        SourceDir dir;
+        dir.setPath(path);
+        dir.setPattern(pattern);
+        dirs.append(dir);
     }
-    delete process;
-    delete archive;
-    query.exec("COMMIT TRANSACTION");
+    scanPatterns.clear();
+    for (int i=0; i < dirs.size(); i++)
+        scanPatterns.append(loadPattern(dirs.at(i)));
+    candidates = 0;
+    processed = 0;
+    knownFileNames.clear();
+    deferredFiles.clear();
+    resultBuffer.clear();
+    failedDirs.clear();
+    droppedPaths = getDragDropFiles().toSet();
+    loadFingerprints();
+    commitTimer.start();
+
+    // Walk, validate and write all at once: new files are handed to the pool as soon as the walk finds them and written
+    // in batches as the results come back
+    findKaraokeFiles(dirs);
+    writeResults(true);
+
+    // Songs without a fingerprint yet can only be matched by file name, against the files held back for that
+    emit stateChanged("Detecting and updating moved files...");
+    QStringList missingFiles = getMissingDbFiles();
+    reconcileMovedFiles(missingFiles);
+    emit progressMaxChanged(0);
+    // Whatever wasn't claimed by a missing song is a new song after all
+    QHash<QString, int>::const_iterator deferred;
+    for (deferred = deferredFiles.constBegin(); deferred != deferredFiles.constEnd(); ++deferred)
+        queueCandidate(deferred.key(), deferred.value(), false);
+    deferredFiles.clear();
+    writeResults(true);
+    knownFileNames.clear();
+
+    // Only once the new songs are in, otherwise an interrupted scan would leave them behind directories marked unchanged
+    saveDirSnapshots();
+    // Cached zip directories of archives that are gone from the library
+    QSet<QString> zipPaths;
+    QSqlQuery query(db);
+    query.exec("SELECT path FROM dbsongs");
+    while (query.next())
+    {
+        if (query.value(0).toString().endsWith(".zip", Qt::CaseInsensitive))
+            zipPaths.insert(query.value(0).toString());
+    }
+    OkArchive::pruneIndex(zipPaths);
+    backfillFingerprints(scanRoots, missingFiles.toSet());
+    fingerprints.clear();
+    fingerprintedPaths.clear();
+    movedPaths.clear();
+    emit progressMessage("Found " + QString::number(candidates) + " potential karaoke files.");
     emit progressMessage("Done processing new files.");
     if (errors.size() > 0)
     {
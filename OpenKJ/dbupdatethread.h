@@ -23,7 +23,42 @@
 
 #include <QThread>
 #include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QQueue>
+#include <QFuture>
+#include <QThreadPool>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
 #include "sourcedirtablemodel.h"
+#include "dirwalker.h"
+
+// Outcome of validating and parsing one file during a scan
+struct ScanResult
+{
+    QString path;
+    bool valid;
+    QString error;
+    QString artist;
+    QString title;
+    QString discid;
+    int duration;
+    // File size plus a hash of its first and last few KB, used to recognize the song after a move or rename
+    QString fingerprint;
+};
+
+// Naming pattern of a source dir, looked up before the scan starts since the pool threads can't use the database
+struct ScanPattern
+{
+    SourceDir::NamingPattern pattern;
+    bool customValid;
+    QString artistRegex;
+    int artistCaptureGrp;
+    QString titleRegex;
+    int titleCaptureGrp;
+    QString songIdRegex;
+    int songIdCaptureGrp;
+};
 
 class DbUpdateThread : public QThread
 {
@@ -32,7 +67,44 @@ class DbUpdateThread : public QThread
 private:
     QString path;
     SourceDir::NamingPattern pattern;
+    QList<SourceDir> sourceDirs;
+    QList<ScanPattern> scanPatterns;
+    // The scan's own connection to the song database, only valid inside run()
+    QString dbFileName;
+    QSqlDatabase db;
+    void scan();
+    // Filled in by findKaraokeFiles(), directories that didn't change since the last scan aren't listed again
+    QStringList missingInTree;
+    QStringList scanRoots;
+    QHash<QString, DirSnapshot> newSnapshots;
+    QStringList removedDirs;
+    // Directories with files that failed validation, their snapshot is saved as never scanned
+    QSet<QString> failedDirs;
     bool dbEntryExists(QString filepath);
+    // Scan pipeline: the walk queues new files on scanPool and the results are written in order as they come back
+    QThreadPool scanPool;
+    QQueue<QFuture<ScanResult> > pendingResults;
+    QList<ScanResult> resultBuffer;
+    QElapsedTimer commitTimer;
+    QSet<QString> knownFileNames;
+    // Fingerprint to path of the songs that have one, and the old paths of songs found moved during this scan
+    QMultiHash<QString, QString> fingerprints;
+    QSet<QString> fingerprintedPaths;
+    QSet<QString> movedPaths;
+    QSet<QString> droppedPaths;
+    // Path and source dir index of files that might be moved songs
+    QHash<QString, int> deferredFiles;
+    int candidates;
+    int processed;
+    void saveDirSnapshots();
+    ScanPattern loadPattern(SourceDir dir);
+    void queueCandidate(QString fileName, int sourceDir, bool allowDefer = true);
+    void writeResults(bool waitForAll);
+    void commitResults();
+    void loadFingerprints();
+    QString movedFrom(const ScanResult &result);
+    void backfillFingerprints(QStringList roots, QSet<QString> missingFiles);
+    void reconcileMovedFiles(QStringList missingFiles);
 
 public:
     explicit DbUpdateThread(QObject *parent = 0);
@@ -41,7 +113,10 @@ public:
     void setPath(const QString &value);
     int getPattern() const;
     void setPattern(SourceDir::NamingPattern value);
-    QStringList findKaraokeFiles(QString directory);
+    // Scans several source dirs in one go, their trees are walked at the same time.  Takes the place of setPath() and
+    // setPattern().
+    void setSourceDirs(QList<SourceDir> dirs);
+    void findKaraokeFiles(QList<SourceDir> dirs);
     QStringList getMissingDbFiles();
     QStringList getDragDropFiles();
     QStringList getErrors();
@@ -51,6 +126,8 @@ public:
 
 signals:
     void threadFinished();
+    // New songs were committed while the scan is still running, the ui copies them into mem.dbsongs
+    void songsAdded();
     void errorsGenerated(QStringList);
     void progressMessage(QString msg);
     void stateChanged(QString state);
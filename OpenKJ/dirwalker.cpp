@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dirwalker.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QtConcurrent>
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sysmacros.h>
+#endif
+
+#define DIRWALK_THREADS 8
+// Directories listed at once on a device that isn't known to be a spinning disk: SSDs, network shares, etc
+#define DIRWALK_THREADS_PER_DEVICE 4
+// Listings waiting for the consumer
+#define DIRWALK_RESULT_LIMIT 64
+
+DirWalker::DirWalker()
+{
+    pool.setMaxThreadCount(DIRWALK_THREADS);
+    scanned = 0;
+    activeDirs = 0;
+    activeWorkers = 0;
+    stopping = false;
+}
+
+DirWalker::~DirWalker()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+void DirWalker::setSnapshots(const QHash<QString, DirSnapshot> &snapshots)
+{
+    this->snapshots = snapshots;
+    childDirs.clear();
+    QHash<QString, DirSnapshot>::const_iterator it;
+    for (it = snapshots.constBegin(); it != snapshots.constEnd(); ++it)
+        childDirs[it.key().left(it.key().lastIndexOf('/'))].append(it.key());
+}
+
+void DirWalker::start(QStringList roots)
+{
+    QMutexLocker locker(&mutex);
+    scanned = QDateTime::currentMSecsSinceEpoch();
+    stopping = false;
+    for (int i=0; i < roots.size(); i++)
+    {
+        PendingDir dir;
+        dir.path = roots.at(i);
+        dir.root = i;
+        dir.device = -1;
+        pending.append(dir);
+    }
+    activeWorkers = pool.maxThreadCount();
+    for (int i=0; i < activeWorkers; i++)
+        QtConcurrent::run(&pool, this, &DirWalker::worker);
+}
+
+bool DirWalker::next(DirListing &listing)
+{
+    QMutexLocker locker(&mutex);
+    while (results.isEmpty())
+    {
+        if (activeWorkers == 0)
+            return false;
+        resultAvailable.wait(&mutex);
+    }
+    listing = results.dequeue();
+    resultSpace.wakeOne();
+    return true;
+}
+
+void DirWalker::cancel()
+{
+    QMutexLocker locker(&mutex);
+    stopping = true;
+    workAvailable.wakeAll();
+    resultSpace.wakeAll();
+}
+
+int DirWalker::deviceLimit(qint64 device)
+{
+    if (deviceLimits.contains(device))
+        return deviceLimits.value(device);
+    int limit = DIRWALK_THREADS_PER_DEVICE;
+#ifdef Q_OS_LINUX
+    if (device >= 0)
+    {
+        // Partitions don't have a queue of their own, the disk they're on does
+        QString sysfs = "/sys/dev/block/" + QString::number(major(device)) + ":" + QString::number(minor(device));
+        QFile rotational(sysfs + "/queue/rotational");
+        if (!rotational.exists())
+            rotational.setFileName(sysfs + "/../queue/rotational");
+        if ((rotational.open(QIODevice::ReadOnly)) && (rotational.readAll().trimmed() == "1"))
+            limit = 1;
+    }
+#endif
+    deviceLimits.insert(device, limit);
+    return limit;
+}
+
+bool DirWalker::listDir(const PendingDir &dir, DirListing &listing, QList<PendingDir> &subdirs)
+{
+    listing.path = dir.path;
+    listing.root = dir.root;
+    listing.listed = true;
+    listing.state.entries = 0;
+    listing.state.scanned = scanned;
+    qint64 device;
+#ifdef Q_OS_UNIX
+    QByteArray encodedPath = QFile::encodeName(dir.path);
+    struct stat st;
+    if ((::stat(encodedPath.constData(), &st) != 0) || (!S_ISDIR(st.st_mode)))
+        return false;
+    listing.state.mtime = (qint64)st.st_mtime * 1000;
+    listing.state.inode = st.st_ino;
+    device = st.st_dev;
+#else
+    QFileInfo info(dir.path);
+    if (!info.isDir())
+        return false;
+    listing.state.mtime = info.lastModified().toMSecsSinceEpoch();
+    listing.state.inode = 0;
+    device = 0;
+#endif
+    PendingDir subdir;
+    subdir.root = dir.root;
+    subdir.device = device;
+    QHash<QString, DirSnapshot>::const_iterator snapshot = snapshots.constFind(dir.path);
+    if (snapshot != snapshots.constEnd())
+    {
+        const DirSnapshot &previous = snapshot.value();
+        if ((previous.mtime == listing.state.mtime) && (previous.inode == listing.state.inode) && (listing.state.mtime < previous.scanned - DIR_MTIME_SLACK))
+        {
+            // Nothing was added, removed or renamed here, only the subdirectories need a look
+            listing.listed = false;
+            listing.state.entries = previous.entries;
+            QStringList children = childDirs.value(dir.path);
+            for (int i=0; i < children.size(); i++)
+            {
+                subdir.path = children.at(i);
+                subdirs.append(subdir);
+            }
+            return true;
+        }
+    }
+#ifdef Q_OS_UNIX
+    DIR *handle = opendir(encodedPath.constData());
+    if (handle == NULL)
+        return false;
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL)
+    {
+        // Hidden entries are skipped, like QDir does by default
+        if (entry->d_name[0] == '.')
+            continue;
+        listing.state.entries++;
+        QString entryPath = dir.path + "/" + QFile::decodeName(entry->d_name);
+        unsigned char type = entry->d_type;
+        if ((type == DT_UNKNOWN) || (type == DT_LNK))
+        {
+            // Not every filesystem fills in the type, and links have to be followed to see what they point at.
+            // Linked directories aren't walked into, linked files are used.
+            QByteArray encodedEntry = QFile::encodeName(entryPath);
+            struct stat entrySt;
+            if ((type == DT_UNKNOWN) && (::lstat(encodedEntry.constData(), &entrySt) == 0) && (S_ISDIR(entrySt.st_mode)))
+                type = DT_DIR;
+            else if ((::stat(encodedEntry.constData(), &entrySt) == 0) && (S_ISREG(entrySt.st_mode)))
+                type = DT_REG;
+            else
+                continue;
+        }
+        if (type == DT_DIR)
+        {
+            subdir.path = entryPath;
+            subdirs.append(subdir);
+        }
+        else if (type == DT_REG)
+            listing.files.append(entryPath);
+    }
+    closedir(handle);
+#else
+    QDirIterator iterator(dir.path, QDir::AllEntries | QDir::NoDotAndDotDot);
+    while (iterator.hasNext())
+    {
+        iterator.next();
+        listing.state.entries++;
+        QFileInfo entry = iterator.fileInfo();
+        if (entry.isDir())
+        {
+            if (!entry.isSymLink())
+            {
+                subdir.path = iterator.filePath();
+                subdirs.append(subdir);
+            }
+        }
+        else
+            listing.files.append(iterator.filePath());
+    }
+#endif
+    return true;
+}
+
+void DirWalker::worker()
+{
+    QMutexLocker locker(&mutex);
+    forever
+    {
+        if (stopping)
+            break;
+        // Depth first, from the end of the list, skipping directories on devices that are already at their limit
+        int index = -1;
+        for (int i=pending.size() - 1; i >= 0; i--)
+        {
+            if (busyDevices.value(pending.at(i).device) < deviceLimit(pending.at(i).device))
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index == -1)
+        {
+            if ((pending.isEmpty()) && (activeDirs == 0))
+                break;
+            workAvailable.wait(&mutex);
+            continue;
+        }
+        PendingDir dir = pending.takeAt(index);
+        busyDevices[dir.device]++;
+        activeDirs++;
+        locker.unlock();
+        DirListing listing;
+        QList<PendingDir> subdirs;
+        bool listed = listDir(dir, listing, subdirs);
+        locker.relock();
+        busyDevices[dir.device]--;
+        pending.append(subdirs);
+        if (listed)
+        {
+            while ((results.size() >= DIRWALK_RESULT_LIMIT) && (!stopping))
+                resultSpace.wait(&mutex);
+            results.enqueue(listing);
+            resultAvailable.wakeOne();
+        }
+        // Only now, so the walk can't look finished while a listing is still on its way to the queue
+        activeDirs--;
+        workAvailable.wakeAll();
+    }
+    activeWorkers--;
+    workAvailable.wakeAll();
+    resultAvailable.wakeAll();
+}
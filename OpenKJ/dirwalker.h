@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DIRWALKER_H
+#define DIRWALKER_H
+
+#include <QStringList>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+
+// Directory mtimes only change when entries are added, removed or renamed.  A directory whose mtime is this close to the
+// time it was last listed may have changed again within the same timestamp tick (FAT has 2 second mtimes).  Shared by
+// everything that trusts a directory listing based on its mtime.
+#define DIR_MTIME_SLACK 2000
+
+// State of a directory when it was last listed by a scan, kept in the dirSnapshots table
+struct DirSnapshot
+{
+    qint64 mtime;
+    int entries;
+    qint64 inode;
+    qint64 scanned;
+};
+
+// One directory as seen by the walker.  Directories that match their snapshot aren't listed, files is empty for those.
+struct DirListing
+{
+    QString path;
+    int root;
+    bool listed;
+    DirSnapshot state;
+    QStringList files;
+};
+
+// Walks several directory trees at once.  Directories are listed on a thread pool, with a cap on how many are listed at
+// the same time on each device so a spinning disk isn't made to seek back and forth between them.  On unix the entry
+// type comes from readdir(), so files aren't stat'ed one by one.
+// The listings are handed to a single consumer through next(), which blocks until one is ready.  The number waiting to
+// be picked up is capped as well, a slow consumer holds the walk back rather than letting it run away.
+
+class DirWalker
+{
+public:
+    DirWalker();
+    ~DirWalker();
+    // Directories that match their snapshot are reported with listed set to false, the subdirectories recorded in the
+    // snapshots are walked instead.  Must be set before start().
+    void setSnapshots(const QHash<QString, DirSnapshot> &snapshots);
+    void start(QStringList roots);
+    bool next(DirListing &listing);
+    void cancel();
+
+private:
+    struct PendingDir
+    {
+        QString path;
+        int root;
+        qint64 device;
+    };
+    QThreadPool pool;
+    QMutex mutex;
+    QWaitCondition workAvailable;
+    QWaitCondition resultAvailable;
+    QWaitCondition resultSpace;
+    QList<PendingDir> pending;
+    QQueue<DirListing> results;
+    QHash<qint64, int> busyDevices;
+    QHash<qint64, int> deviceLimits;
+    QHash<QString, DirSnapshot> snapshots;
+    QHash<QString, QStringList> childDirs;
+    qint64 scanned;
+    int activeDirs;
+    int activeWorkers;
+    bool stopping;
+    int deviceLimit(qint64 device);
+    bool listDir(const PendingDir &dir, DirListing &listing, QList<PendingDir> &subdirs);
+    void worker();
+};
+
+#endif // DIRWALKER_H
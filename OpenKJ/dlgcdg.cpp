@@ -47,6 +47,7 @@ DlgCdg::DlgCdg(AbstractAudioBackend *KaraokeBackend, AbstractAudioBackend *Break
 {
     kAudioBackend = KaraokeBackend;
     bAudioBackend = BreakBackend;
+    cdgUpdateSkipped = true;
     if (settings->cdgWindowFullScreenMonitor() > QApplication::desktop()->numScreens())
     {
         settings->setCdgWindowFullscreen(false);
@@ -145,6 +146,23 @@ void DlgCdg::updateCDG(QImage image, bool overrideVisibleCheck)
     }
 }
 
+void DlgCdg::updateCDG(const CDG_Frame_Handle &frame)
+{
+    if (!isVisible())
+    {
+        cdgUpdateSkipped = true;
+        return;
+    }
+    // Frames were skipped while hidden, the partial update can't be trusted
+    ui->cdgVideo->videoSurface()->presentCdgFrame(frame, cdgUpdateSkipped);
+    cdgUpdateSkipped = false;
+}
+
+void DlgCdg::detachCdgFrame()
+{
+    ui->cdgVideo->videoSurface()->detachCdgFrame();
+}
+
 void DlgCdg::makeFullscreen()
 {
     m_fullScreen = true;
@@ -49,6 +49,7 @@ private:
     QTimer *fullScreenTimer;
     QTimer *slideShowTimer;
     bool showBgImage;
+    bool cdgUpdateSkipped;
     QTimer *alertCountdownTimer;
     int countdownPos;
     QTimer *buttonShowTimer;
@@ -60,6 +61,8 @@ public:
     explicit DlgCdg(AbstractAudioBackend *KaraokeBackend, AbstractAudioBackend *BreakBackend, QWidget *parent = 0, Qt::WindowFlags f = 0);
     ~DlgCdg();
     void updateCDG(QImage image, bool overrideVisibleCheck = false);
+    void updateCDG(const CDG_Frame_Handle &frame);
+    void detachCdgFrame();
     void makeFullscreen();
     void makeWindowed();
     void setTickerText(QString text);
@@ -23,6 +23,9 @@
 #include <QMessageBox>
 #include <QDebug>
 #include "okarchive.h"
+#include "cdgcache.h"
+
+extern CdgCache *cdgCache;
 
 DlgCdgPreview::DlgCdgPreview(QWidget *parent) :
     QDialog(parent),
@@ -64,7 +67,7 @@ void DlgCdgPreview::preview()
             close();
             return;
         }
-        cdg->FileOpen(archive.getCDGData());
+        cdgCache->open(cdg, archive.getCDGData(), false);
     }
     else if (m_srcFile.endsWith(".cdg", Qt::CaseInsensitive))
     {
@@ -75,9 +78,10 @@ void DlgCdgPreview::preview()
             close();
             return;
         }
-        cdg->FileOpen(m_srcFile.toStdString());
+        cdgFile.open(QIODevice::ReadOnly);
+        cdgCache->open(cdg, cdgFile.readAll(), false);
+        cdgFile.close();
     }
-    cdg->Process();
     timer->start(40);
 }
 
@@ -88,11 +92,8 @@ void DlgCdgPreview::timerTimeout()
     {
         if (cdg->GetLastCDGUpdate() >= cdgPosition)
         {
-            unsigned char* rgbdata;
-            rgbdata = cdg->GetImageByTime(cdgPosition);
-            QImage img(rgbdata, 300, 216, QImage::Format_RGB888);
-            ui->cdgVideoWidget->videoSurface()->present(QVideoFrame(img));
-            free(rgbdata);
+            CDG_Frame_Handle frame = cdg->GetIndexedFrameByTime(cdgPosition);
+            ui->cdgVideoWidget->videoSurface()->presentCdgFrame(frame);
             cdgPosition = cdgPosition + timer->interval();
         }
         else
@@ -26,8 +26,10 @@
 #include <QSqlQuery>
 #include <QMessageBox>
 #include "dbupdatethread.h"
+#include "okarchive.h"
 #include "settings.h"
 #include <QStandardPaths>
+#include <QEventLoop>
 
 extern Settings *settings;
 
@@ -45,6 +47,11 @@ DlgDatabase::DlgDatabase(QSqlDatabase db, QWidget *parent) :
     selectedRow = -1;
     customPatternsDlg = new DlgCustomPatterns(this);
     dbUpdateDlg = new DlgDbUpdate(this);
+    auditor = new LibraryAuditor(this);
+    connect(auditor, SIGNAL(stateChanged(QString)), dbUpdateDlg, SLOT(changeStatusTxt(QString)));
+    connect(auditor, SIGNAL(progressMaxChanged(int)), dbUpdateDlg, SLOT(setProgressMax(int)));
+    connect(auditor, SIGNAL(progressChanged(int)), dbUpdateDlg, SLOT(changeProgress(int)));
+    connect(auditor, SIGNAL(finished(int,int)), this, SLOT(auditor_finished(int,int)));
 }
 
 DlgDatabase::~DlgDatabase()
@@ -146,6 +153,7 @@ void DlgDatabase::on_buttonUpdate_clicked()
         connect(updateThread, SIGNAL(stateChanged(QString)), dbUpdateDlg, SLOT(changeStatusTxt(QString)));
         connect(updateThread, SIGNAL(progressMaxChanged(int)), dbUpdateDlg, SLOT(setProgressMax(int)));
         connect(updateThread, SIGNAL(progressChanged(int)), dbUpdateDlg, SLOT(changeProgress(int)));
+        connect(updateThread, SIGNAL(songsAdded()), this, SIGNAL(songsAdded()));
         dbUpdateDlg->changeDirectory(sourcedirmodel->getDirByIndex(selectedRow)->getPath());
         dbUpdateDlg->show();
 //        QMessageBox msgBox;
@@ -156,11 +164,10 @@ void DlgDatabase::on_buttonUpdate_clicked()
         updateThread->setPath(sourcedirmodel->getDirByIndex(selectedRow)->getPath());
         updateThread->setPattern(sourcedirmodel->getDirByIndex(selectedRow)->getPattern());
         QApplication::processEvents();
+        QEventLoop loop;
+        connect(updateThread, SIGNAL(finished()), &loop, SLOT(quit()));
         updateThread->start();
-        while (updateThread->isRunning())
-        {
-            QApplication::processEvents();
-        }
+        loop.exec();
         emit databaseUpdated();
         QApplication::processEvents();
         dbUpdateDlg->changeStatusTxt("Database update complete!");
@@ -175,30 +182,35 @@ void DlgDatabase::on_buttonUpdate_clicked()
 
 void DlgDatabase::on_buttonUpdateAll_clicked()
 {
+    if (sourcedirmodel->size() == 0)
+        return;
     DbUpdateThread *updateThread = new DbUpdateThread(this);
     dbUpdateDlg->reset();
     connect(updateThread, SIGNAL(progressMessage(QString)), dbUpdateDlg, SLOT(addProgressMsg(QString)));
     connect(updateThread, SIGNAL(stateChanged(QString)), dbUpdateDlg, SLOT(changeStatusTxt(QString)));
     connect(updateThread, SIGNAL(progressMaxChanged(int)), dbUpdateDlg, SLOT(setProgressMax(int)));
     connect(updateThread, SIGNAL(progressChanged(int)), dbUpdateDlg, SLOT(changeProgress(int)));
+    connect(updateThread, SIGNAL(songsAdded()), this, SIGNAL(songsAdded()));
     dbUpdateDlg->show();
 
     //QMessageBox msgBox;
     //msgBox.setStandardButtons(0);
     //msgBox.setText("Updating Database, please wait...");
     //msgBox.show();
+    // All source dirs go to a single scan, their trees are walked side by side
+    QList<SourceDir> dirs;
+    QStringList paths;
     for (int i=0; i < sourcedirmodel->size(); i++)
     {
-        //msgBox.setInformativeText("Processing path: " + sourcedirmodel->getDirByIndex(i)->getPath());
-        dbUpdateDlg->changeDirectory(sourcedirmodel->getDirByIndex(i)->getPath());
-        updateThread->setPath(sourcedirmodel->getDirByIndex(i)->getPath());
-        updateThread->setPattern(sourcedirmodel->getDirByIndex(i)->getPattern());
-        updateThread->start();
-        while (updateThread->isRunning())
-        {
-            QApplication::processEvents();
-        }
+        dirs.append(*sourcedirmodel->getDirByIndex(i));
+        paths.append(sourcedirmodel->getDirByIndex(i)->getPath());
     }
+    dbUpdateDlg->changeDirectory(paths.join(", "));
+    updateThread->setSourceDirs(dirs);
+    QEventLoop loop;
+    connect(updateThread, SIGNAL(finished()), &loop, SLOT(quit()));
+    updateThread->start();
+    loop.exec();
 //    msgBox.setInformativeText("Reloading song database into cache");
     emit databaseUpdated();
 //    msgBox.hide();
@@ -220,6 +232,10 @@ void DlgDatabase::on_btnClearDatabase_clicked()
     if (msgBox.clickedButton() == yesButton) {
         QSqlQuery query;
         query.exec("DELETE FROM dbSongs");
+        // Otherwise the next update would skip every unchanged directory and never find the songs again
+        query.exec("DELETE FROM dirSnapshots");
+        query.exec("DELETE FROM songFingerprints");
+        OkArchive::pruneIndex(QSet<QString>());
         query.exec("DELETE FROM regularsongs");
         query.exec("DELETE FROM regularsingers");
         query.exec("DELETE FROM queuesongs");
@@ -279,3 +295,50 @@ void DlgDatabase::on_btnExport_clicked()
         csvFile.close();
     }
 }
+
+void DlgDatabase::on_btnVerify_clicked()
+{
+    if (auditor->isRunning())
+    {
+        auditor->cancel();
+        return;
+    }
+    bool resume = false;
+    if (auditor->canResume())
+    {
+        QMessageBox msgBox;
+        msgBox.setText("Resume verification?");
+        msgBox.setInformativeText("The last verification was stopped before it finished.  Would you like to continue where it left off, or start over?");
+        msgBox.setIcon(QMessageBox::Question);
+        QPushButton *resumeButton = msgBox.addButton("Resume", QMessageBox::YesRole);
+        msgBox.addButton("Start Over", QMessageBox::NoRole);
+        msgBox.exec();
+        resume = (msgBox.clickedButton() == resumeButton);
+    }
+    dbUpdateDlg->reset();
+    dbUpdateDlg->changeDirectory("All songs");
+    dbUpdateDlg->show();
+    ui->btnVerify->setText("Stop Verifying");
+    auditor->start(resume);
+}
+
+void DlgDatabase::auditor_finished(int checked, int failed)
+{
+    ui->btnVerify->setText("Verify Files");
+    dbUpdateDlg->hide();
+    QMessageBox msgBox;
+    if (auditor->canResume())
+        msgBox.setText("Verification stopped after checking " + QString::number(checked) + " files.  It can be resumed later.");
+    else
+        msgBox.setText("Verification complete.  " + QString::number(checked) + " files checked, " + QString::number(failed) + " problems found.");
+    QStringList failures = auditor->failures();
+    if (failures.count() > 0)
+    {
+        msgBox.setInformativeText("Some files in the database are damaged or incomplete.");
+        msgBox.setDetailedText(failures.join("\n"));
+        QSpacerItem* horizontalSpacer = new QSpacerItem(600, 0, QSizePolicy::Minimum, QSizePolicy::Expanding);
+        QGridLayout* layout = (QGridLayout*)msgBox.layout();
+        layout->addItem(horizontalSpacer, layout->rowCount(), 0, 1, layout->columnCount());
+    }
+    msgBox.exec();
+}
@@ -28,6 +28,7 @@
 #include "dlgcustompatterns.h"
 #include <QSqlDatabase>
 #include "dlgdbupdate.h"
+#include "libraryauditor.h"
 
 namespace Ui {
 class DlgDatabase;
@@ -42,6 +43,7 @@ private:
     SourceDirTableModel *sourcedirmodel;
     DlgCustomPatterns *customPatternsDlg;
     DlgDbUpdate *dbUpdateDlg;
+    LibraryAuditor *auditor;
     int selectedRow;
     QSqlDatabase db;
 
@@ -52,6 +54,7 @@ public:
 signals:
     void databaseUpdated();
     void databaseCleared();
+    void songsAdded();
 
 public slots:
     void singleSongAdd(QString path);
@@ -69,6 +72,8 @@ private slots:
     void showDbUpdateErrors(QStringList errors);
     void on_btnCustomPatterns_clicked();
     void on_btnExport_clicked();
+    void on_btnVerify_clicked();
+    void auditor_finished(int checked, int failed);
 };
 
 #endif // DATABASEDIALOG_H
@@ -4,6 +4,7 @@
 #include <QTemporaryDir>
 #include "tagreader.h"
 #include "okarchive.h"
+#include "siblingindex.h"
 #include <QSqlQuery>
 
 void KaraokeFileInfo::readTags()
@@ -14,17 +15,7 @@ void KaraokeFileInfo::readTags()
 
     if (fileName.endsWith(".cdg", Qt::CaseInsensitive))
     {
-        QString baseFn = fileName;
-        QString mediaFile;
-        baseFn.chop(3);
-        if (QFile::exists(baseFn + "mp3"))
-            mediaFile = baseFn + "mp3";
-        else if (QFile::exists(baseFn + "Mp3"))
-            mediaFile = baseFn + "Mp3";
-        else if (QFile::exists(baseFn + "MP3"))
-            mediaFile = baseFn + "MP3";
-        else if (QFile::exists(baseFn + "mP3"))
-            mediaFile = baseFn + "mP3";
+        QString mediaFile = SiblingIndex::companion(fileName, "mp3");
         tagReader->setMedia(mediaFile);
         tagArtist = tagReader->getArtist();
         tagTitle = tagReader->getTitle();
@@ -28,6 +28,7 @@
 #include <vector>
 #include <stdlib.h>
 #include "libCDG_Frame_Image.h"
+#include "libCDG_Frame_Store.h"
 #include "libCDG_Color.h"
 #include <QByteArray>
 #include <QBuffer>
@@ -49,6 +50,13 @@
 #define MODE_FILE           0
 #define MODE_QIODEVICE       1
 
+#define CDG_PACKETS_PER_FRAME      12
+#define CDG_CHECKPOINT_INTERVAL  3000
+#define CDG_STREAM_FLAG_HISTORY    64
+#define CDG_FRAME_POOL_SIZE         3
+#define CDG_FRAME_BUFFER_SIZE  194400
+#define CDG_MIN_SEGMENT_FRAMES    250
+
 using namespace std;
 
 //! A struct representing the data contained in a cdg packet
@@ -109,10 +117,100 @@ struct CDG_Scroll_CMD
 	char	vScroll;
 };
 
+//! A struct holding a snapshot of the decoder's screen state
+/*!
+    Saved periodically while streaming so seeking backwards doesn't have to decode from the start of the file.
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+struct CDG_Checkpoint
+{
+	unsigned int	packet;
+	CDG_Color	colors[16];
+	unsigned char	map[216][300];
+};
+
+//! A struct holding the change flags of a streamed frame
+/*!
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+struct CDG_Frame_Flags
+{
+	int		frame;
+	bool		changed;
+	bool		fullUpdate;
+	CDG_Tile_Bitmap	tiles;
+};
+
+//! A rectangle on the cdg screen, in pixels
+struct CDG_Rect
+{
+	int	x;
+	int	y;
+	int	width;
+	int	height;
+};
+
+class CDG;
+
+//! A struct describing a run of packets that can be decoded independently of the rest of the file
+/*!
+    Segments start at the frame containing a memory preset, which overwrites the whole screen, so the only state carried
+    over from the previous segment is the palette.
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+struct CDG_Segment
+{
+	const char	*data;
+	unsigned int	firstFrame;
+	unsigned int	endFrame;
+	CDG_Color	colors[16];
+	CDG		*decoder;
+};
+
+//! A handle to a frame rendered into one of the decoder's reusable frame buffers
+/*!
+    The buffer is owned by the CDG object.  It is only overwritten after CDG_FRAME_POOL_SIZE - 1 more distinct frames have
+    been rendered, so a display can keep using it until the next frame replaces it.
+*/
+struct CDG_Frame_Handle
+{
+	const unsigned char	*data;
+	int			width;
+	int			height;
+	int			bytesPerLine;
+	unsigned int		frame;
+	bool			changed;
+	CDG_Rect		dirty;
+	bool			indexed;
+	const unsigned int	*colorTable;
+	bool			paletteChanged;
+};
+
+//! A struct representing one of the decoder's reusable frame buffers
+/*!
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+struct CDG_Pool_Buffer
+{
+	unsigned char	*data;
+	unsigned int	frame;
+	unsigned int	version;
+	bool		indexed;
+	unsigned int	colorTable[16];
+	bool		valid;
+};
+
 //! A C++ class for decoding cdg (karaoke graphics) files
 /*!
     A class that decodes CDG files into a series of bitmaps which can be displayed in a program.
     Normally you will begin by creating the object, then using the FileOpen(), Process(), and GetImageByTime() functions.
+    For playback, StreamStart() can be used in place of Process() to skip decoding the whole file up front.
+
+    Threading: all decoder state lives in the object, so separate CDG objects can be used concurrently from different
+    threads, for example decoding the next song on a worker thread while another object plays the current one.  A single
+    object is not thread safe, every call on it (including the frame getters, which advance the stream and reuse internal
+    buffers) must come from one thread at a time.  Process() may use the global QThreadPool internally, but doesn't
+    return until it's done with it.
 */
 class CDG
 {
@@ -138,9 +236,36 @@ public:
 	      Processes the contents of a CDG file to generate libCDG's internal
 	      frame array.  On a moderately powered computer, this should take under half a second.
 	      Once this finishes, libCDG is ready to serve up images for display in your program.
+	      Files with memory presets at least CDG_MIN_SEGMENT_FRAMES apart are split at those points and the pieces are
+	      decoded concurrently on the global QThreadPool.
 	      \return true on success and false on failure
 	*/
 	bool Process(bool clear = true);
+    //! Prepare an opened CDG file for streaming playback
+    /*!
+        Alternative to Process().  Rather than decoding every frame up front, libCDG only keeps the current screen state and
+        advances it packet by packet (300 packets per second) to whatever position is requested from GetImageByTime().
+        Seeking backwards replays from the nearest checkpoint, which are saved every 10 seconds of playback.  The time this
+        takes doesn't depend on the length of the file.
+        \return true on success and false on failure
+    */
+    bool StreamStart();
+    //! Whether the currently opened file is being streamed rather than pre-processed
+    bool IsStreaming() { return Streaming; }
+    //! Save the processed frames so they can be loaded again later without decoding
+    /*!
+        Only available after Process(), a streamed file has no frames to save.
+        \return the serialized timeline, empty if there's nothing to save
+    */
+    QByteArray SaveTimeline();
+    //! Open a timeline saved by SaveTimeline() in place of opening and processing a cdg file
+    /*!
+        The data is copied, so it can be unmapped or freed as soon as this returns.
+        \param data Serialized timeline, for example a memory mapped cache file
+        \param size Size of the data in bytes
+        \return true on success or false if the data isn't a valid timeline
+    */
+    bool LoadTimeline(const char *data, qint64 size);
     //! Determine whether frame at position ms is a duplicate of the previous frame
     /*!
         This function is used to determine whether the frame at postion ms is a duplicate of the previous frame.  This is useful
@@ -174,6 +299,28 @@ public:
         \param pRGB Pointer to a malloc'd array of unsigned char
 	*/
 	void GetImageByTime(unsigned int ms, unsigned char * pRGB);
+    //! Retrieve a frame without allocating any memory
+    /*!
+        Renders the frame at the specified position into one of a small pool of aligned buffers owned by the CDG object
+        and returns a handle to it.  Data is in the same RGB format as GetImageByTime().  If the frame is identical to the
+        one returned by the previous call, the same buffer is returned without rendering and changed is set to false.
+        Buffers are updated incrementally, only the tiles that changed since a buffer was last used are converted.
+        The dirty rect of the handle bounds the area that differs from the frame returned by the previous call, it is empty
+        if nothing changed.
+        \param ms Position to get a video frame for, in milliseconds
+        \return a handle to the rendered frame.  Its data is NULL if the buffer pool couldn't be allocated.
+    */
+    CDG_Frame_Handle GetFrameByTime(unsigned int ms);
+    //! Retrieve a frame as palette indexes without allocating any memory
+    /*!
+        Same as GetFrameByTime(), but the buffer holds one palette index (0-15) per pixel, 300 bytes per line, and the
+        handle's colorTable holds the 16 palette entries as 0xffRRGGBB.  This maps directly onto QImage::Format_Indexed8.
+        No palette expansion is done, and a frame that only differs from the previous one by its palette doesn't touch
+        any pixels, paletteChanged is set and the caller just swaps the colour table.
+        \param ms Position to get a video frame for, in milliseconds
+        \return a handle to the rendered frame
+    */
+    CDG_Frame_Handle GetIndexedFrameByTime(unsigned int ms);
 	//! Get the length of the cdg file, in milliseconds
 	/*!
         Gets the length of the currently opened and processed cdg file, in milliseconds.
@@ -181,17 +328,33 @@ public:
 	*/
 	unsigned int GetDuration()
 	{
-		return CDGVideo.size() * 40;
+		return GetFrameCount() * 40;
 	}
 	bool IsOpen() {
         return Open;
 	}
+    //! Get the tiles that differ between two positions
+    /*!
+        Tiles are 6x12 pixels, there are CDG_TILE_COLS x CDG_TILE_ROWS of them.  Bit (row * CDG_TILE_COLS + column) is set
+        for every tile that was drawn to between the two positions.  The positions can be given in either order.
+        \param fromMs First position, in milliseconds
+        \param toMs Second position, in milliseconds
+        \param tiles Bitmap to receive the dirty tiles
+        \return true if the whole screen needs to be redrawn
+    */
+    bool GetDirtyTilesByTime(unsigned int fromMs, unsigned int toMs, CDG_Tile_Bitmap &tiles);
+    //! Get the areas of the screen that differ between two positions
+    /*!
+        Same as GetDirtyTilesByTime(), but with neighbouring dirty tiles merged into rectangles, in pixels.
+        \return the dirty rectangles, empty if the two frames are identical
+    */
+    vector<CDG_Rect> GetDirtyRects(unsigned int fromMs, unsigned int toMs);
     unsigned int GetLastCDGUpdate() { return LastCDGCommandMS; }
-    unsigned char *GetCDGRowByTime(unsigned int ms, unsigned int row);
-    bool RowNeedsUpdate(unsigned int ms, int row);
     bool AllNeedUpdate(unsigned int ms);
     int tempo();
     void setTempo(int percent);
+    //! Get the amount of memory used by the decoded frames, in bytes
+    size_t GetMemoryUsage() { return CDGVideo.MemoryUsage(); }
 protected:
 private:
     int m_tempo;
@@ -204,6 +367,24 @@ private:
 	void CMDBorderPreset(char data[16]);
 	void CMDTileBlock(char data[16], bool XOR = false);
 	void CMDColors(char data[16], int Table);
+	static void DecodeColors(const char data[16], int Table, CDG_Color colors[16]);
+	bool ProcessSegments();
+	static void DecodeSegment(CDG_Segment &segment);
+	void StoreFrame(int frame);
+	unsigned int GetFrameCount();
+	CDG_Frame_Image *GetFrame(unsigned int frameno);
+	void StreamSeek(unsigned int frameno);
+	void StreamReset();
+	const CDG_Frame_Flags &StreamFrameFlags(unsigned int frameno);
+	bool IsCommandPacket(const CDG_SubCode &SubCode);
+	unsigned int GetFrameVersion(unsigned int frameno);
+	unsigned int FrameForTime(unsigned int ms);
+	CDG_Frame_Handle RenderFrame(unsigned int frameno, bool indexed);
+	bool DirtyTilesBetween(unsigned int fromFrame, unsigned int toFrame, CDG_Tile_Bitmap &tiles, bool pixelsOnly = false);
+	void ConvertDirtyTiles(CDG_Frame_Image *img, const CDG_Tile_Bitmap &tiles, unsigned char *pData, bool indexed);
+	static CDG_Rect TilesBoundingRect(const CDG_Tile_Bitmap &tiles);
+	void InvalidateFramePool();
+	void SetAllTilesDirty();
 	unsigned int GetPosMS();
 	unsigned int LastCDGCommandMS;
     bool Open;
@@ -212,14 +393,20 @@ private:
     QByteArray cdgData;
 	unsigned int CurPos;
     CDG_Frame_Image *CDGImage;
-	char masks[6];
 	bool needupdate;
 	CDG_Color colors[16];
-	vector<CDG_Frame_Image *> CDGVideo;
-	vector<int> ChangedRows;
+	CDG_Frame_Store CDGVideo;
+	CDG_Tile_Bitmap DirtyTiles;
 	bool NeedFullUpdate;
-	vector<bool> SkipFrames;
     int mode;
+	bool Streaming;
+	unsigned int StreamPackets;
+	vector<CDG_Checkpoint> Checkpoints;
+	CDG_Frame_Flags StreamFlags[CDG_STREAM_FLAG_HISTORY];
+	unsigned int StreamVersion;
+	unsigned char *FramePoolMem;
+	CDG_Pool_Buffer FramePool[CDG_FRAME_POOL_SIZE];
+	int FramePoolLast;
 };
 
 #endif // LIBCDG_H
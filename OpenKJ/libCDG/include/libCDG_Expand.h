@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of libCDG.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBCDG_EXPAND_H
+#define LIBCDG_EXPAND_H
+
+#include "libCDG_Color.h"
+
+//! Palette split into one 16 entry table per channel
+/*!
+    This layout lets the SIMD kernels look up 16 or 32 pixels per channel with a single byte shuffle.
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+struct CDG_Palette_Tables
+{
+    unsigned char r[16];
+    unsigned char g[16];
+    unsigned char b[16];
+};
+
+//! Build the per-channel lookup tables for a palette
+void CDG_Build_Palette_Tables(const CDG_Color colors[16], CDG_Palette_Tables &tables);
+//! Expand 4 bit palette indexes to RGB888 (RGBRGB...)
+/*!
+    Uses an AVX2 or SSSE3 shuffle based lookup when the cpu supports it, picked at runtime, otherwise a scalar loop.
+    \param indexes Palette indexes, one per byte.  Values must be 0-15.
+    \param count Number of pixels to expand
+    \param tables Palette tables built by CDG_Build_Palette_Tables()
+    \param out Destination, count * 3 bytes
+*/
+void CDG_Expand_RGB(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out);
+//! Expand 4 bit palette indexes to RGBX8888 (RGBXRGBX...), with X set to 0xFF
+/*!
+    Same as CDG_Expand_RGB(), but writes count * 4 bytes.  The output can be used directly as QImage::Format_RGBX8888.
+*/
+void CDG_Expand_RGBX(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out);
+//! Name of the expansion kernel selected for this cpu, for logging
+const char *CDG_Expand_Kernel();
+
+#endif // LIBCDG_EXPAND_H
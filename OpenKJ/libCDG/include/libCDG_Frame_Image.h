@@ -25,6 +25,7 @@
 #include <vector>
 #include <stdlib.h>
 #include "libCDG_Color.h"
+#include "libCDG_Expand.h"
 
 
 class CDG_Frame_Image
@@ -36,17 +37,16 @@ public:
     char GetCDG_Color(int x, int y);
 	unsigned char *Get_RGB_Data();
 	void Get_RGB_Data(unsigned char * pRGB);
+    void Get_RGBX_Data(unsigned char * pRGBX);
+    void Get_RGB_Rect(int x, int y, int w, int h, unsigned char * pRGB, int bytesPerLine);
+    void Get_RGBX_Rect(int x, int y, int w, int h, unsigned char * pRGBX, int bytesPerLine);
+    void Get_Index_Rect(int x, int y, int w, int h, unsigned char * pIndex, int bytesPerLine);
+    void Get_Color_Table(unsigned int table[16]);
 	unsigned char CDG_Map[216][300];
 	CDG_Color colors[16];
-	void SetChangedRows(std::vector<int> rows) { ChangedRows = rows; }
-    void ChangedRowAdd(int val) { ChangedRows.push_back(val); }
-    bool RowChanged(int row);
-    std::vector<int> GetChangedRows() { return ChangedRows; }
-    unsigned char *Get_Row_Data(int cdgrow);
     bool NeedFullUpdate;
 private:
 	bool Skip;
-	std::vector<int> ChangedRows;
 	unsigned int LastUpdate;
 };
 
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of libCDG.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBCDG_FRAME_STORE_H
+#define LIBCDG_FRAME_STORE_H
+
+#include <vector>
+#include <bitset>
+#include "libCDG_Frame_Image.h"
+#include "libCDG_Color.h"
+
+#define CDG_TILE_WIDTH        6
+#define CDG_TILE_HEIGHT      12
+#define CDG_TILE_COLS        50
+#define CDG_TILE_ROWS        18
+#define CDG_TILE_COUNT      900
+#define CDG_KEYFRAME_INTERVAL 250
+
+#define CDG_RECORD_KEYFRAME   0x01
+#define CDG_RECORD_PALETTE    0x02
+#define CDG_RECORD_FULLUPDATE 0x04
+
+#define CDG_TIMELINE_MAGIC    "OKCDGTL"
+#define CDG_TIMELINE_VERSION  2
+
+typedef std::bitset<CDG_TILE_COUNT> CDG_Tile_Bitmap;
+
+//! Compact timeline of decoded cdg frames
+/*!
+    Stores the output of the decoder as periodic keyframes plus per-frame deltas.  A delta only holds the 6x12 tiles that
+    were touched since the previous frame and the palette, if it changed.  Frames that are identical to their predecessor
+    don't store anything, they just point at the previous record.  Pixels are packed two per byte.
+    Frames are rebuilt on request by applying deltas to the nearest keyframe.  The last rebuilt frame is kept around, so
+    sequential playback only ever applies a single delta per frame.
+    This is used internally by libCDG and is not meant for direct access or use.
+*/
+class CDG_Frame_Store
+{
+public:
+    CDG_Frame_Store();
+    ~CDG_Frame_Store();
+    //! Remove all frames and free the memory used by them
+    void Clear();
+    //! Move all frames of another timeline to the end of this one, leaving the other timeline empty
+    /*!
+        The first frame of the other timeline must be a keyframe, which is always the case for a timeline that was
+        filled from scratch.
+    */
+    void Append(CDG_Frame_Store &other);
+    //! Append a frame to the end of the timeline
+    /*!
+        \param image Current decoder screen state
+        \param colors Current decoder palette
+        \param dirtyTiles Tiles touched since the previous frame was added
+        \param fullUpdate Whether the frame requires a full redraw
+        \param changed Whether anything changed since the previous frame.  Unchanged frames reuse the previous record.
+    */
+    void AddFrame(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, bool fullUpdate, bool changed);
+    //! Number of frames in the timeline
+    unsigned int FrameCount() const { return m_frameRecords.size(); }
+    //! Whether the frame is a duplicate of the frame before it
+    bool IsDuplicate(unsigned int frame) const;
+    //! Index of the record a frame is built from.  Frames with the same record are identical.
+    unsigned int RecordForFrame(unsigned int frame) const;
+    bool NeedFullUpdate(unsigned int frame) const;
+    //! Find the tiles that differ between two frames
+    /*!
+        Sets the bit of every tile touched by any record between the two frames.  The frames can be given in either order.
+        \param tiles Bitmap to add the tiles to.  Existing bits are left set.
+        \param pixelsOnly Only report tiles whose palette indexes changed, ignoring palette changes
+        \return true if the whole screen changed (palette change, memory preset, etc), in which case all bits are set
+    */
+    bool DirtyTiles(unsigned int fromFrame, unsigned int toFrame, CDG_Tile_Bitmap &tiles, bool pixelsOnly = false) const;
+    //! Rebuild a frame
+    /*!
+        The returned image is owned by the store and is only valid until the next call to GetFrame() or Clear().
+    */
+    CDG_Frame_Image *GetFrame(unsigned int frame);
+    //! Approximate memory used by the timeline, in bytes
+    size_t MemoryUsage() const;
+    //! Size of the timeline written by Serialize(), in bytes
+    size_t SerializedSize() const;
+    //! Write the timeline to a flat buffer
+    /*!
+        The format is a fixed header followed by the record and frame tables as 32 bit integers and the record data, so
+        it can be read straight out of a memory mapped file.  It is in native byte order, Deserialize() rejects data
+        written on a machine with a different byte order.
+        \param out Buffer of at least SerializedSize() bytes
+    */
+    void Serialize(unsigned char *out) const;
+    //! Replace the timeline with one written by Serialize()
+    /*!
+        \return false if the data is truncated, corrupt or from an incompatible version, the timeline is left empty
+    */
+    bool Deserialize(const unsigned char *in, size_t size);
+
+private:
+    void WriteKeyframe(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, unsigned int tileCount, unsigned char flags);
+    void WriteDelta(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, unsigned int tileCount, unsigned char flags);
+    void WritePalette(const CDG_Color colors[16]);
+    void ApplyRecord(unsigned int record);
+    std::vector<unsigned char> m_data;
+    std::vector<unsigned int> m_recordOffsets;
+    std::vector<unsigned int> m_recordKeyframes;
+    std::vector<unsigned int> m_frameRecords;
+    CDG_Color m_lastColors[16];
+    unsigned int m_recordsSinceKeyframe;
+    CDG_Frame_Image *m_work;
+    int m_workRecord;
+};
+
+#endif // LIBCDG_FRAME_STORE_H
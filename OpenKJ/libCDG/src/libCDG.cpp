@@ -20,17 +20,34 @@
 
 #include "../include/libCDG.h"
 #include <QDebug>
+#include <QtConcurrent>
+#include <algorithm>
 
 #define UNUSED(x) (void)x
 
+// Lookup table for the tile blitter, maps a 6 bit tile row to a byte mask with 0xFF for each set pixel.  The leftmost
+// pixel is the high bit of the row and the first byte of the mask.
+struct CDG_Row_Masks
+{
+    unsigned long long select[64];
+    CDG_Row_Masks()
+    {
+        for (unsigned int bits = 0; bits < 64; bits++)
+        {
+            unsigned char bytes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            for (unsigned int j = 0; j < CDG_TILE_WIDTH; j++)
+            {
+                if (bits & (0x20 >> j))
+                    bytes[j] = 0xFF;
+            }
+            memcpy(&select[bits], bytes, sizeof(bytes));
+        }
+    }
+};
+static const CDG_Row_Masks RowMasks;
+
 CDG::CDG()
 {
-    masks[0] = 0x20;
-    masks[1] = 0x10;
-    masks[2] = 0x08;
-    masks[3] = 0x04;
-    masks[4] = 0x02;
-    masks[5] = 0x01;
     CDGImage = new CDG_Frame_Image();
     LastCDGCommandMS = 0;
     Open = false;
@@ -39,8 +56,15 @@ CDG::CDG()
     CurPos = 0;
     needupdate = true;
     NeedFullUpdate = true;
+    DirtyTiles.set();
     mode = MODE_FILE;
     m_tempo = 100;
+    Streaming = false;
+    StreamPackets = 0;
+    StreamVersion = 0;
+    // The frame pool is allocated on first use, decoders used for processing only never need it
+    FramePoolMem = NULL;
+    InvalidateFramePool();
 }
 
 bool CDG::FileOpen(string filename)
@@ -82,13 +106,13 @@ void CDG::FileClose()
 
 void CDG::VideoClose()
 {
-    for(unsigned int i=0; i<CDGVideo.size(); i++)
-    {
-        if (!SkipFrames.at(i))
-            delete(CDGVideo.at(i));
-    }
-    CDGVideo.clear();
-    SkipFrames.clear();
+    CDGVideo.Clear();
+    vector<CDG_Checkpoint>().swap(Checkpoints);
+    cdgData.clear();
+    Streaming = false;
+    StreamPackets = 0;
+    InvalidateFramePool();
+    DirtyTiles.set();
     CurPos = 0;
     CDGFileOpened = false;
     Open = false;
@@ -104,9 +128,11 @@ bool CDG::SkipFrame(int ms)
 {
     bool retval = false;
     unsigned int frame = ms / 40;
-    if ((ms % 40 < 0) && (SkipFrames.size() > frame + 1) && (SkipFrames.at(frame + 1)))
+    if (Streaming)
+        return !StreamFrameFlags(frame).changed;
+    if ((ms % 40 < 0) && (CDGVideo.IsDuplicate(frame + 1)))
         retval = true;
-    if ((SkipFrames.at(frame)) && (SkipFrames.size() > frame))
+    if (CDGVideo.IsDuplicate(frame))
         retval = true;
     return retval;
 }
@@ -117,12 +143,13 @@ bool CDG::Process(bool clear)
 
     needupdate = true;
     CDG_SubCode SubCode;
-    static int lastupdate;
-    static int frame;
     if (clear)
     {
-        lastupdate = 0;
-        frame = 0;
+        if (ProcessSegments())
+        {
+            Open = true;
+            return true;
+        }
     }
     if (mode == MODE_FILE)
     {
@@ -136,31 +163,7 @@ bool CDG::Process(bool clear)
                     CurPos++;
                     if (((GetPosMS() % 40) == 0) && (GetPosMS() >= 40))
                     {
-                        CDG_Frame_Image *img;;
-                        if (needupdate)
-                        {
-                            LastCDGCommandMS = frame * 40;
-                            lastupdate = frame;
-                            needupdate = false;
-                            img = new CDG_Frame_Image();
-                            for (unsigned int i=0; i < ChangedRows.size(); i++)
-                            {
-                                img->ChangedRowAdd(ChangedRows.at(i));
-                            }
-                            img->NeedFullUpdate = NeedFullUpdate;
-                            NeedFullUpdate = false;
-                            ChangedRows.clear();
-                            memcpy(&img->colors, &colors,sizeof(img->colors));
-                            memcpy(&img->CDG_Map, &CDGImage->CDG_Map, sizeof(img->CDG_Map));
-                            SkipFrames.push_back(false);
-                        }
-                        else
-                        {
-                            img = CDGVideo.at(lastupdate);
-                            SkipFrames.push_back(true);
-                        }
-                        CDGVideo.push_back(img);
-                        frame++;
+                        StoreFrame(CDGVideo.FrameCount());
                     }
                 }
                 else
@@ -190,31 +193,7 @@ bool CDG::Process(bool clear)
                 CurPos++;
                 if (((GetPosMS() % 40) == 0) && (GetPosMS() >= 40))
                 {
-                    CDG_Frame_Image *img;;
-                    if (needupdate)
-                    {
-                        LastCDGCommandMS = frame * 40;
-                        lastupdate = frame;
-                        needupdate = false;
-                        img = new CDG_Frame_Image();
-                        for (unsigned int i=0; i < ChangedRows.size(); i++)
-                        {
-                            img->ChangedRowAdd(ChangedRows.at(i));
-                        }
-                        img->NeedFullUpdate = NeedFullUpdate;
-                        NeedFullUpdate = false;
-                        ChangedRows.clear();
-                        memcpy(&img->colors, &colors,sizeof(img->colors));
-                        memcpy(&img->CDG_Map, &CDGImage->CDG_Map, sizeof(img->CDG_Map));
-                        SkipFrames.push_back(false);
-                    }
-                    else
-                    {
-                        img = CDGVideo.at(lastupdate);
-                        SkipFrames.push_back(true);
-                    }
-                    CDGVideo.push_back(img);
-                    frame++;
+                    StoreFrame(CDGVideo.FrameCount());
                 }
             }
             else
@@ -232,7 +211,333 @@ bool CDG::Process(bool clear)
     }
     return false;
 }
+bool CDG::ProcessSegments()
+{
+    if (mode == MODE_FILE)
+    {
+        if (!CDGFileOpened)
+            return false;
+        cdgData.clear();
+        char buffer[65536];
+        size_t bytes;
+        while ((bytes = fread(buffer, 1, sizeof(buffer), CDGFile)) > 0)
+            cdgData.append(buffer, bytes);
+        FileClose();
+        // A partial packet at the end of a file is never decoded
+        cdgData.truncate(cdgData.size() - (cdgData.size() % sizeof(CDG_SubCode)));
+        mode = MODE_QIODEVICE;
+    }
+    if (cdgData.size() % sizeof(CDG_SubCode) != 0)
+        return false;
+    const char *data = cdgData.constData();
+    unsigned int frames = cdgData.size() / sizeof(CDG_SubCode) / CDG_PACKETS_PER_FRAME;
+    if (frames < CDG_MIN_SEGMENT_FRAMES * 2)
+        return false;
+    // Sequential pre-pass, only looks at palette and memory preset packets.  The palette at the start of each frame is
+    // tracked so a segment can begin at the frame containing the preset.
+    vector<CDG_Segment> segments;
+    CDG_Color palette[16];
+    CDG_Color frameStartPalette[16];
+    CDG_Segment segment;
+    segment.data = data;
+    segment.firstFrame = 0;
+    segment.decoder = NULL;
+    for (unsigned int i=0; i < 16; i++)
+        segment.colors[i] = palette[i];
+    CDG_SubCode SubCode;
+    for (unsigned int packet=0; packet < frames * CDG_PACKETS_PER_FRAME; packet++)
+    {
+        if (packet % CDG_PACKETS_PER_FRAME == 0)
+        {
+            for (unsigned int i=0; i < 16; i++)
+                frameStartPalette[i] = palette[i];
+        }
+        memcpy(&SubCode, data + (packet * sizeof(CDG_SubCode)), sizeof(CDG_SubCode));
+        if ((SubCode.command & SC_MASK) != SC_CDG_COMMAND)
+            continue;
+        switch (SubCode.instruction & SC_MASK)
+        {
+        case CDG_COLORSLOW:
+            DecodeColors(SubCode.data, CDG_COLOR_TABLE_LOW, palette);
+            break;
+        case CDG_COLORSHIGH:
+            DecodeColors(SubCode.data, CDG_COLOR_TABLE_HIGH, palette);
+            break;
+        case CDG_MEMORYPRESET:
+        {
+            unsigned int frame = packet / CDG_PACKETS_PER_FRAME;
+            if ((frame - segment.firstFrame >= CDG_MIN_SEGMENT_FRAMES) && (frames - frame >= CDG_MIN_SEGMENT_FRAMES))
+            {
+                segment.endFrame = frame;
+                segments.push_back(segment);
+                segment.firstFrame = frame;
+                for (unsigned int i=0; i < 16; i++)
+                    segment.colors[i] = frameStartPalette[i];
+            }
+            break;
+        }
+        }
+    }
+    segment.endFrame = frames;
+    segments.push_back(segment);
+    if (segments.size() < 2)
+        return false;
+    QtConcurrent::blockingMap(segments, DecodeSegment);
+    CDGVideo.Clear();
+    LastCDGCommandMS = 0;
+    for (unsigned int i=0; i < segments.size(); i++)
+    {
+        CDGVideo.Append(segments[i].decoder->CDGVideo);
+        if (segments[i].decoder->LastCDGCommandMS > LastCDGCommandMS)
+            LastCDGCommandMS = segments[i].decoder->LastCDGCommandMS;
+        delete segments[i].decoder;
+    }
+    // Leave the decoder in the same state a sequential decode would
+    CDG_Frame_Image *last = CDGVideo.GetFrame(frames - 1);
+    memcpy(&CDGImage->CDG_Map, &last->CDG_Map, sizeof(CDGImage->CDG_Map));
+    for (unsigned int i=0; i < 16; i++)
+        colors[i] = palette[i];
+    CurPos = frames * CDG_PACKETS_PER_FRAME;
+    needupdate = false;
+    NeedFullUpdate = false;
+    DirtyTiles.reset();
+    return true;
+}
+
+void CDG::DecodeSegment(CDG_Segment &segment)
+{
+    CDG *decoder = new CDG();
+    for (unsigned int i=0; i < 16; i++)
+        decoder->colors[i] = segment.colors[i];
+    CDG_SubCode SubCode;
+    for (unsigned int packet = segment.firstFrame * CDG_PACKETS_PER_FRAME; packet < segment.endFrame * CDG_PACKETS_PER_FRAME; packet++)
+    {
+        memcpy(&SubCode, segment.data + (packet * sizeof(CDG_SubCode)), sizeof(CDG_SubCode));
+        decoder->CDG_Read_SubCode_Packet(SubCode);
+        if ((packet + 1) % CDG_PACKETS_PER_FRAME == 0)
+            decoder->StoreFrame(packet / CDG_PACKETS_PER_FRAME);
+    }
+    segment.decoder = decoder;
+}
 
+QByteArray CDG::SaveTimeline()
+{
+    QByteArray timeline;
+    if ((Streaming) || (CDGVideo.FrameCount() == 0))
+        return timeline;
+    // Timeline is prefixed with the position of the last cdg command, 8 bytes to keep the tables aligned
+    timeline.resize(8 + CDGVideo.SerializedSize());
+    unsigned int header[2];
+    header[0] = LastCDGCommandMS;
+    header[1] = 0;
+    memcpy(timeline.data(), header, sizeof(header));
+    CDGVideo.Serialize((unsigned char *)timeline.data() + 8);
+    return timeline;
+}
+
+bool CDG::LoadTimeline(const char *data, qint64 size)
+{
+    VideoClose();
+    if (size < 8)
+        return false;
+    if (!CDGVideo.Deserialize((const unsigned char *)data + 8, size - 8))
+        return false;
+    unsigned int header[2];
+    memcpy(header, data, sizeof(header));
+    LastCDGCommandMS = header[0];
+    Open = true;
+    return true;
+}
+
+bool CDG::StreamStart()
+{
+    if (mode == MODE_FILE)
+    {
+        if (!CDGFileOpened)
+            return false;
+        cdgData.clear();
+        char buffer[65536];
+        size_t bytes;
+        while ((bytes = fread(buffer, 1, sizeof(buffer), CDGFile)) > 0)
+            cdgData.append(buffer, bytes);
+        FileClose();
+    }
+    StreamPackets = cdgData.size() / sizeof(CDG_SubCode);
+    if (StreamPackets < CDG_PACKETS_PER_FRAME)
+    {
+        qCritical() << "CDG data too short to stream";
+        return false;
+    }
+    Streaming = true;
+    vector<CDG_Checkpoint>().swap(Checkpoints);
+    StreamReset();
+    // Find the last frame that contains a cdg command without decoding anything
+    LastCDGCommandMS = 0;
+    const char *data = cdgData.constData();
+    CDG_SubCode SubCode;
+    for (int i = GetFrameCount() * CDG_PACKETS_PER_FRAME - 1; i >= 0; i--)
+    {
+        memcpy(&SubCode, data + (i * sizeof(CDG_SubCode)), sizeof(CDG_SubCode));
+        if (IsCommandPacket(SubCode))
+        {
+            LastCDGCommandMS = (i / CDG_PACKETS_PER_FRAME) * 40;
+            break;
+        }
+    }
+    Open = true;
+    return true;
+}
+
+void CDG::StreamReset()
+{
+    memset(&CDGImage->CDG_Map, 0, sizeof(CDGImage->CDG_Map));
+    for (unsigned int i=0; i < 16; i++)
+        colors[i] = CDG_Color();
+    CurPos = 0;
+    StreamVersion++;
+    needupdate = true;
+    NeedFullUpdate = true;
+    DirtyTiles.set();
+    for (unsigned int i=0; i < CDG_STREAM_FLAG_HISTORY; i++)
+        StreamFlags[i].frame = -1;
+}
+
+const CDG_Frame_Flags &CDG::StreamFrameFlags(unsigned int frameno)
+{
+    if (frameno >= GetFrameCount())
+        frameno = GetFrameCount() - 1;
+    // Recently decoded frames are answered from the history so querying a frame just behind the current
+    // position doesn't force a replay from the last checkpoint
+    CDG_Frame_Flags &flags = StreamFlags[frameno % CDG_STREAM_FLAG_HISTORY];
+    if (flags.frame != (int)frameno)
+    {
+        StreamSeek(frameno);
+        flags.frame = frameno;
+        flags.changed = needupdate;
+        flags.fullUpdate = NeedFullUpdate;
+        flags.tiles = DirtyTiles;
+    }
+    return flags;
+}
+
+void CDG::StreamSeek(unsigned int frameno)
+{
+    if (frameno >= GetFrameCount())
+        frameno = GetFrameCount() - 1;
+    unsigned int target = (frameno + 1) * CDG_PACKETS_PER_FRAME;
+    unsigned int checkpoint = target / CDG_CHECKPOINT_INTERVAL;
+    if (checkpoint > Checkpoints.size())
+        checkpoint = Checkpoints.size();
+    if ((target < CurPos) || ((checkpoint > 0) && (Checkpoints.at(checkpoint - 1).packet > CurPos)))
+    {
+        // Jump to the closest checkpoint at or before the target instead of decoding everything in between
+        if (checkpoint == 0)
+            StreamReset();
+        else
+        {
+            const CDG_Checkpoint &cp = Checkpoints.at(checkpoint - 1);
+            memcpy(&CDGImage->CDG_Map, &cp.map, sizeof(CDGImage->CDG_Map));
+            for (unsigned int i=0; i < 16; i++)
+                colors[i] = cp.colors[i];
+            CurPos = cp.packet;
+            StreamVersion++;
+            needupdate = true;
+            NeedFullUpdate = true;
+            DirtyTiles.set();
+        }
+    }
+    const char *data = cdgData.constData();
+    CDG_SubCode SubCode;
+    while (CurPos < target)
+    {
+        if ((CurPos % CDG_PACKETS_PER_FRAME == 0) && (CurPos > 0))
+        {
+            // Start of a new frame, only track changes made within it
+            needupdate = false;
+            NeedFullUpdate = false;
+            DirtyTiles.reset();
+        }
+        memcpy(&SubCode, data + (CurPos * sizeof(CDG_SubCode)), sizeof(CDG_SubCode));
+        if (IsCommandPacket(SubCode))
+            StreamVersion++;
+        CDG_Read_SubCode_Packet(SubCode);
+        CurPos++;
+        if (CurPos % CDG_PACKETS_PER_FRAME == 0)
+        {
+            CDG_Frame_Flags &flags = StreamFlags[(CurPos / CDG_PACKETS_PER_FRAME - 1) % CDG_STREAM_FLAG_HISTORY];
+            flags.frame = CurPos / CDG_PACKETS_PER_FRAME - 1;
+            flags.changed = needupdate;
+            flags.fullUpdate = NeedFullUpdate;
+            flags.tiles = DirtyTiles;
+        }
+        if ((CurPos % CDG_CHECKPOINT_INTERVAL == 0) && (CurPos / CDG_CHECKPOINT_INTERVAL > Checkpoints.size()))
+        {
+            Checkpoints.push_back(CDG_Checkpoint());
+            CDG_Checkpoint &cp = Checkpoints.back();
+            cp.packet = CurPos;
+            memcpy(&cp.map, &CDGImage->CDG_Map, sizeof(cp.map));
+            for (unsigned int i=0; i < 16; i++)
+                cp.colors[i] = colors[i];
+        }
+    }
+}
+
+bool CDG::IsCommandPacket(const CDG_SubCode &SubCode)
+{
+    if ((SubCode.command & SC_MASK) != SC_CDG_COMMAND)
+        return false;
+    switch (SubCode.instruction & SC_MASK)
+    {
+    case CDG_MEMORYPRESET:
+    case CDG_BORDERPRESET:
+    case CDG_TILEBLOCK:
+    case CDG_SCROLLPRESET:
+    case CDG_SCROLLCOPY:
+    case CDG_DEFINETRANS:
+    case CDG_COLORSLOW:
+    case CDG_COLORSHIGH:
+    case CDG_TILEBLOCKXOR:
+        return true;
+    }
+    return false;
+}
+
+unsigned int CDG::GetFrameCount()
+{
+    if (Streaming)
+        return StreamPackets / CDG_PACKETS_PER_FRAME;
+    return CDGVideo.FrameCount();
+}
+
+CDG_Frame_Image *CDG::GetFrame(unsigned int frameno)
+{
+    if (Streaming)
+    {
+        StreamSeek(frameno);
+        memcpy(&CDGImage->colors, &colors, sizeof(CDGImage->colors));
+        CDGImage->NeedFullUpdate = NeedFullUpdate;
+        return CDGImage;
+    }
+    return CDGVideo.GetFrame(frameno);
+}
+
+void CDG::StoreFrame(int frame)
+{
+    if (needupdate)
+        LastCDGCommandMS = frame * 40;
+    CDGVideo.AddFrame(CDGImage, colors, DirtyTiles, NeedFullUpdate, needupdate);
+    if (needupdate)
+    {
+        needupdate = false;
+        NeedFullUpdate = false;
+        DirtyTiles.reset();
+    }
+}
+
+void CDG::SetAllTilesDirty()
+{
+    DirtyTiles.set();
+}
 
 void CDG::CDG_Read_SubCode_Packet(CDG_SubCode &SubCode)
 {
@@ -291,6 +596,7 @@ void CDG::CMDBorderPreset(char data[16])
     preset.color = (data[0] & 0x0F);
     if (preset.color <= 15)
     {
+        SetAllTilesDirty();
         // Top rows
         for (unsigned int y = 0; y < 12; y++)
         {
@@ -318,11 +624,22 @@ void CDG::CMDBorderPreset(char data[16])
 
 void CDG::CMDColors(char data[16], int Table)
 {
-    static CDG_Color original[16];
+    CDG_Color original[16];
     for (unsigned int i=0; i < 16; i++)
     {
         original[i] = colors[i];
     }
+    DecodeColors(data, Table, colors);
+    bool change = false;
+    for (unsigned int i=0; i < 16; i++)
+    {
+        if (colors[i] != original[i]) change = true;
+    }
+    if (change) NeedFullUpdate = true;
+}
+
+void CDG::DecodeColors(const char data[16], int Table, CDG_Color colors[16])
+{
     char highbyte, lowbyte;
     int i, j, red, green, blue;
     i = 0;
@@ -369,12 +686,6 @@ void CDG::CMDColors(char data[16], int Table)
         colors[j].SetRGB(red, green, blue);
         j++;
     }
-    bool change = false;
-    for (unsigned int i=0; i < 16; i++)
-    {
-        if (colors[i] != original[i]) change = true;
-    }
-    if (change) NeedFullUpdate = true;
 }
 
 void CDG::CMDDefineTrans(char data[16])
@@ -390,6 +701,7 @@ void CDG::CMDMemoryPreset(char data[16])
     preset.repeat = (data[1] & 0x0F);
     if (preset.color <= 15)
     {
+        SetAllTilesDirty();
         memset(&CDGImage->CDG_Map, preset.color, sizeof(CDGImage->CDG_Map));
     }
 }
@@ -407,54 +719,35 @@ void CDG::CMDScrollPreset(char data[16])
 void CDG::CMDTileBlock(char data[16], bool XOR)
 {
     CDG_Tile_Block tile;
-    int top, left, i, j;
     tile.color0 = (data[0] & 0x0F);
     tile.color1 = (data[1] & 0x0F);
     tile.row = (data[2] & 0x1F);
     tile.column = (data[3] & 0x3F);
-    tile.tilePixels[0]  = data[4];
-    tile.tilePixels[1]  = data[5];
-    tile.tilePixels[2]  = data[6];
-    tile.tilePixels[3]  = data[7];
-    tile.tilePixels[4]  = data[8];
-    tile.tilePixels[5]  = data[9];
-    tile.tilePixels[6]  = data[10];
-    tile.tilePixels[7]  = data[11];
-    tile.tilePixels[8]  = data[12];
-    tile.tilePixels[9]  = data[13];
-    tile.tilePixels[10] = data[14];
-    tile.tilePixels[11] = data[15];
-    ChangedRows.push_back(tile.row);
-    top  = (tile.row    * 12);
-    left = (tile.column * 6);
-    for (i = 0; i <= 11; i++)
-    {
-        for (j = 0; j <= 5; j++)
+    // Tiles are either fully on screen or fully off it, row 18+ and column 50+ start past the edge of the map
+    if ((tile.row >= CDG_TILE_ROWS) || (tile.column >= CDG_TILE_COLS))
+        return;
+    DirtyTiles.set((tile.row * CDG_TILE_COLS) + tile.column);
+    // Every byte of the pattern is color0, with color1 swapped in where the row mask has a bit set
+    unsigned long long fill0 = tile.color0 * 0x0101010101010101ULL;
+    unsigned long long swap = (tile.color0 ^ tile.color1) * 0x0101010101010101ULL;
+    unsigned char *dst = &CDGImage->CDG_Map[tile.row * CDG_TILE_HEIGHT][tile.column * CDG_TILE_WIDTH];
+    for (int i = 0; i < CDG_TILE_HEIGHT; i++, dst += sizeof(CDGImage->CDG_Map[0]))
+    {
+        unsigned long long pattern = fill0 ^ (RowMasks.select[data[4 + i] & 0x3F] & swap);
+        if (XOR)
         {
-            if (((top + i) <= 215) && ((left + j) <= 299) && (tile.color0 <= 15) && (tile.color1 <= 15))
-            {
-                if ((tile.tilePixels[i] & masks[j]) > 0)
-                {
-                    int coloridx;
-                    if (XOR) coloridx = CDGImage->GetCDG_Color(left + j, top + i) ^ tile.color1;
-                    else     coloridx = tile.color1;
-                    CDGImage->SetColor(left + j, top + i, coloridx);
-                }
-                else
-                {
-                    int coloridx;
-                    if (XOR) coloridx = CDGImage->GetCDG_Color(left + j, top + i) ^ tile.color0;
-                    else     coloridx = tile.color0;
-                    CDGImage->SetColor(left + j, top + i, coloridx);
-                }
-            }
+            unsigned long long pixels = 0;
+            memcpy(&pixels, dst, CDG_TILE_WIDTH);
+            pattern ^= pixels;
         }
+        memcpy(dst, &pattern, CDG_TILE_WIDTH);
     }
 }
 
 CDG::~CDG()
 {
     delete CDGImage;
+    free(FramePoolMem);
 }
 
 
@@ -464,12 +757,7 @@ unsigned char *CDG::GetImageByTime(unsigned int ms)
     int scaledMs = ms * ((float)m_tempo / 100.0);
     unsigned int frameno = scaledMs / 40;
     if (ms % 40 > 0) frameno++;
-    if (frameno < CDGVideo.size())
-        return CDGVideo.at(frameno)->Get_RGB_Data();
-    else
-    {
-        return CDGVideo.at(CDGVideo.size() -1)->Get_RGB_Data();
-    }
+    return GetFrame(frameno)->Get_RGB_Data();
 }
 
 void CDG::GetImageByTime(unsigned int ms, unsigned char * pRGB)
@@ -477,43 +765,261 @@ void CDG::GetImageByTime(unsigned int ms, unsigned char * pRGB)
     int scaledMs = ms * ((float)m_tempo / 100.0);
     unsigned int frameno = scaledMs / 40;
     if (ms % 40 > 0) frameno++;
-    if (frameno < CDGVideo.size())
-        CDGVideo.at(frameno)->Get_RGB_Data(pRGB);
+    GetFrame(frameno)->Get_RGB_Data(pRGB);
+}
+
+CDG_Frame_Handle CDG::GetFrameByTime(unsigned int ms)
+{
+    return RenderFrame(FrameForTime(ms), false);
+}
+
+CDG_Frame_Handle CDG::GetIndexedFrameByTime(unsigned int ms)
+{
+    return RenderFrame(FrameForTime(ms), true);
+}
+
+CDG_Frame_Handle CDG::RenderFrame(unsigned int frameno, bool indexed)
+{
+    if (FramePoolMem == NULL)
+    {
+        // One allocation for the whole pool, aligned to 64 bytes for the SIMD expansion kernels
+        FramePoolMem = (unsigned char *)malloc((CDG_FRAME_BUFFER_SIZE * CDG_FRAME_POOL_SIZE) + 64);
+        if (FramePoolMem == NULL)
+        {
+            // Nothing to render into, hand back an empty frame and try again on the next call
+            CDG_Frame_Handle handle;
+            memset(&handle, 0, sizeof(handle));
+            handle.indexed = indexed;
+            handle.frame = frameno;
+            return handle;
+        }
+        unsigned char *aligned = FramePoolMem + (64 - ((size_t)FramePoolMem % 64));
+        for (unsigned int i=0; i < CDG_FRAME_POOL_SIZE; i++)
+            FramePool[i].data = aligned + (i * CDG_FRAME_BUFFER_SIZE);
+    }
+    CDG_Frame_Image *img = GetFrame(frameno);
+    unsigned int version = GetFrameVersion(frameno);
+    CDG_Frame_Handle handle;
+    handle.width = 300;
+    handle.height = 216;
+    handle.bytesPerLine = (indexed) ? 300 : 900;
+    handle.indexed = indexed;
+    handle.frame = frameno;
+    handle.paletteChanged = true;
+    handle.dirty.x = 0;
+    handle.dirty.y = 0;
+    handle.dirty.width = 300;
+    handle.dirty.height = 216;
+    bool havePrevious = ((FramePoolLast >= 0) && (FramePool[FramePoolLast].valid) && (FramePool[FramePoolLast].indexed == indexed));
+    if ((havePrevious) && (FramePool[FramePoolLast].version == version))
+    {
+        handle.data = FramePool[FramePoolLast].data;
+        handle.colorTable = FramePool[FramePoolLast].colorTable;
+        handle.changed = false;
+        handle.paletteChanged = false;
+        handle.dirty.width = 0;
+        handle.dirty.height = 0;
+        return handle;
+    }
+    CDG_Tile_Bitmap tiles;
+    if ((havePrevious) && (!DirtyTilesBetween(FramePool[FramePoolLast].frame, frameno, tiles)))
+        handle.dirty = TilesBoundingRect(tiles);
+    int previous = FramePoolLast;
+    FramePoolLast = (FramePoolLast + 1) % CDG_FRAME_POOL_SIZE;
+    CDG_Pool_Buffer &buffer = FramePool[FramePoolLast];
+    // The buffer still holds an older frame, only convert the tiles that changed since then.  Indexed buffers
+    // don't depend on the palette, so a palette change alone doesn't touch any pixels.
+    tiles.reset();
+    bool reuse = ((buffer.valid) && (buffer.indexed == indexed));
+    if ((reuse) && (!DirtyTilesBetween(buffer.frame, frameno, tiles, indexed)))
+        ConvertDirtyTiles(img, tiles, buffer.data, indexed);
+    else if (indexed)
+        img->Get_Index_Rect(0, 0, 300, 216, buffer.data, 300);
     else
+        img->Get_RGB_Data(buffer.data);
+    img->Get_Color_Table(buffer.colorTable);
+    if (havePrevious)
+        handle.paletteChanged = (memcmp(buffer.colorTable, FramePool[previous].colorTable, sizeof(buffer.colorTable)) != 0);
+    buffer.frame = frameno;
+    buffer.version = version;
+    buffer.indexed = indexed;
+    buffer.valid = true;
+    handle.data = buffer.data;
+    handle.colorTable = buffer.colorTable;
+    handle.changed = true;
+    return handle;
+}
+
+bool CDG::GetDirtyTilesByTime(unsigned int fromMs, unsigned int toMs, CDG_Tile_Bitmap &tiles)
+{
+    tiles.reset();
+    return DirtyTilesBetween(FrameForTime(fromMs), FrameForTime(toMs), tiles);
+}
+
+vector<CDG_Rect> CDG::GetDirtyRects(unsigned int fromMs, unsigned int toMs)
+{
+    vector<CDG_Rect> rects;
+    CDG_Tile_Bitmap tiles;
+    if (GetDirtyTilesByTime(fromMs, toMs, tiles))
+    {
+        rects.push_back(TilesBoundingRect(tiles));
+        return rects;
+    }
+    // Merge runs of dirty tiles in each row, then extend a rect downwards while the row below has the same run
+    vector<CDG_Rect> open;
+    for (int row=0; row < CDG_TILE_ROWS; row++)
     {
-        CDGVideo.at(CDGVideo.size() -1)->Get_RGB_Data(pRGB);
+        vector<CDG_Rect> current;
+        int col = 0;
+        while (col < CDG_TILE_COLS)
+        {
+            if (!tiles.test(row * CDG_TILE_COLS + col))
+            {
+                col++;
+                continue;
+            }
+            int start = col;
+            while ((col < CDG_TILE_COLS) && (tiles.test(row * CDG_TILE_COLS + col)))
+                col++;
+            CDG_Rect rect;
+            rect.x = start * CDG_TILE_WIDTH;
+            rect.y = row * CDG_TILE_HEIGHT;
+            rect.width = (col - start) * CDG_TILE_WIDTH;
+            rect.height = CDG_TILE_HEIGHT;
+            for (unsigned int i=0; i < open.size(); i++)
+            {
+                if ((open[i].x == rect.x) && (open[i].width == rect.width))
+                {
+                    rect.y = open[i].y;
+                    rect.height = open[i].height + CDG_TILE_HEIGHT;
+                    open.erase(open.begin() + i);
+                    break;
+                }
+            }
+            current.push_back(rect);
+        }
+        rects.insert(rects.end(), open.begin(), open.end());
+        open.swap(current);
     }
+    rects.insert(rects.end(), open.begin(), open.end());
+    return rects;
 }
-unsigned char *CDG::GetCDGRowByTime(unsigned int ms, unsigned int row)
+
+unsigned int CDG::FrameForTime(unsigned int ms)
 {
-    unsigned int frameno = ms / 40;
+    int scaledMs = ms * ((float)m_tempo / 100.0);
+    unsigned int frameno = scaledMs / 40;
     if (ms % 40 > 0) frameno++;
-    if (frameno < CDGVideo.size())
-        return CDGVideo.at(frameno)->Get_Row_Data(row);
-    else
+    return frameno;
+}
+
+bool CDG::DirtyTilesBetween(unsigned int fromFrame, unsigned int toFrame, CDG_Tile_Bitmap &tiles, bool pixelsOnly)
+{
+    if (!Streaming)
+        return CDGVideo.DirtyTiles(fromFrame, toFrame, tiles, pixelsOnly);
+    unsigned int count = GetFrameCount();
+    if (count == 0)
+        return false;
+    if (fromFrame >= count)
+        fromFrame = count - 1;
+    if (toFrame >= count)
+        toFrame = count - 1;
+    if (fromFrame > toFrame)
+        std::swap(fromFrame, toFrame);
+    // Only frames still in the flag history can be answered without decoding, anything else is a full redraw
+    if (toFrame - fromFrame >= CDG_STREAM_FLAG_HISTORY)
     {
-        return CDGVideo.at(CDGVideo.size() -1)->Get_Row_Data(row);
+        tiles.set();
+        return true;
+    }
+    for (unsigned int f = fromFrame + 1; f <= toFrame; f++)
+    {
+        const CDG_Frame_Flags &flags = StreamFlags[f % CDG_STREAM_FLAG_HISTORY];
+        if ((flags.frame != (int)f) || ((flags.fullUpdate) && (!pixelsOnly)))
+        {
+            tiles.set();
+            return true;
+        }
+        tiles |= flags.tiles;
+    }
+    return tiles.all();
+}
+
+void CDG::ConvertDirtyTiles(CDG_Frame_Image *img, const CDG_Tile_Bitmap &tiles, unsigned char *pData, bool indexed)
+{
+    // Convert each horizontal run of dirty tiles in one go
+    for (int row=0; row < CDG_TILE_ROWS; row++)
+    {
+        int col = 0;
+        while (col < CDG_TILE_COLS)
+        {
+            if (!tiles.test(row * CDG_TILE_COLS + col))
+            {
+                col++;
+                continue;
+            }
+            int start = col;
+            while ((col < CDG_TILE_COLS) && (tiles.test(row * CDG_TILE_COLS + col)))
+                col++;
+            if (indexed)
+                img->Get_Index_Rect(start * CDG_TILE_WIDTH, row * CDG_TILE_HEIGHT, (col - start) * CDG_TILE_WIDTH, CDG_TILE_HEIGHT, pData, 300);
+            else
+                img->Get_RGB_Rect(start * CDG_TILE_WIDTH, row * CDG_TILE_HEIGHT, (col - start) * CDG_TILE_WIDTH, CDG_TILE_HEIGHT, pData, 900);
+        }
     }
+}
 
+CDG_Rect CDG::TilesBoundingRect(const CDG_Tile_Bitmap &tiles)
+{
+    int left = CDG_TILE_COLS, top = CDG_TILE_ROWS, right = -1, bottom = -1;
+    for (int row=0; row < CDG_TILE_ROWS; row++)
+    {
+        for (int col=0; col < CDG_TILE_COLS; col++)
+        {
+            if (!tiles.test(row * CDG_TILE_COLS + col))
+                continue;
+            if (col < left) left = col;
+            if (col > right) right = col;
+            if (row < top) top = row;
+            bottom = row;
+        }
+    }
+    CDG_Rect rect;
+    rect.x = 0;
+    rect.y = 0;
+    rect.width = 0;
+    rect.height = 0;
+    if (right < 0)
+        return rect;
+    rect.x = left * CDG_TILE_WIDTH;
+    rect.y = top * CDG_TILE_HEIGHT;
+    rect.width = (right - left + 1) * CDG_TILE_WIDTH;
+    rect.height = (bottom - top + 1) * CDG_TILE_HEIGHT;
+    return rect;
+}
 
+unsigned int CDG::GetFrameVersion(unsigned int frameno)
+{
+    // Must be called after GetFrame() for the same frame
+    if (Streaming)
+        return StreamVersion;
+    return CDGVideo.RecordForFrame(frameno);
 }
 
-bool CDG::RowNeedsUpdate(unsigned int ms, int row)
+void CDG::InvalidateFramePool()
 {
-    unsigned int frameno = ms / 40;
-    if ((ms % 40 > 0) && (frameno + 1 < CDGVideo.size()) && (CDGVideo.at(frameno + 1)->RowChanged(row)))
-        return true;
-    if ((frameno < CDGVideo.size()) && (CDGVideo.at(frameno)->RowChanged(row)))
-        return true;
-    return false;
+    for (unsigned int i=0; i < CDG_FRAME_POOL_SIZE; i++)
+        FramePool[i].valid = false;
+    FramePoolLast = -1;
 }
+
 bool CDG::AllNeedUpdate(unsigned int ms)
 {
 
     unsigned int frameno = ms / 40;
-    if (frameno < CDGVideo.size())
-    return CDGVideo.at(frameno)->NeedFullUpdate;
-    else return false;
+    if (Streaming)
+        return StreamFrameFlags(frameno).fullUpdate;
+    return CDGVideo.NeedFullUpdate(frameno);
 }
 
 int CDG::tempo()
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of libCDG.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/libCDG_Expand.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CDG_EXPAND_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CDG_TARGET(x)
+#else
+#define CDG_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+typedef void (*CDG_Expand_Func)(const unsigned char *, unsigned int, const CDG_Palette_Tables &, unsigned char *);
+
+struct CDG_Expand_Kernels
+{
+    CDG_Expand_Func rgb;
+    CDG_Expand_Func rgbx;
+    const char *name;
+};
+
+void CDG_Build_Palette_Tables(const CDG_Color colors[16], CDG_Palette_Tables &tables)
+{
+    for (unsigned int i=0; i < 16; i++)
+    {
+        tables.r[i] = colors[i].rgb[0];
+        tables.g[i] = colors[i].rgb[1];
+        tables.b[i] = colors[i].rgb[2];
+    }
+}
+
+static void ExpandRGBScalar(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    for (unsigned int i=0; i < count; i++)
+    {
+        unsigned char idx = indexes[i] & 0x0F;
+        out[0] = tables.r[idx];
+        out[1] = tables.g[idx];
+        out[2] = tables.b[idx];
+        out += 3;
+    }
+}
+
+static void ExpandRGBXScalar(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    for (unsigned int i=0; i < count; i++)
+    {
+        unsigned char idx = indexes[i] & 0x0F;
+        out[0] = tables.r[idx];
+        out[1] = tables.g[idx];
+        out[2] = tables.b[idx];
+        out[3] = 0xFF;
+        out += 4;
+    }
+}
+
+#ifdef CDG_EXPAND_X86
+
+// Spreads the R, G and B lookups for 16 pixels across the three 16 byte blocks of RGB888 output.
+// Shuffle masks are per block and per channel, -128 zeroes the byte.
+CDG_TARGET("ssse3")
+static inline void StoreRGB16(__m128i r, __m128i g, __m128i b, unsigned char *out)
+{
+    const __m128i r0 = _mm_setr_epi8(0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5);
+    const __m128i g0 = _mm_setr_epi8(-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128);
+    const __m128i b0 = _mm_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128);
+    const __m128i r1 = _mm_setr_epi8(-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128);
+    const __m128i g1 = _mm_setr_epi8(5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10);
+    const __m128i b1 = _mm_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128);
+    const __m128i r2 = _mm_setr_epi8(-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128);
+    const __m128i g2 = _mm_setr_epi8(-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128);
+    const __m128i b2 = _mm_setr_epi8(10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15);
+    __m128i o0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0));
+    __m128i o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1));
+    __m128i o2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2));
+    _mm_storeu_si128((__m128i *)out, o0);
+    _mm_storeu_si128((__m128i *)(out + 16), o1);
+    _mm_storeu_si128((__m128i *)(out + 32), o2);
+}
+
+CDG_TARGET("ssse3")
+static void ExpandRGBSSSE3(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    const __m128i tr = _mm_loadu_si128((const __m128i *)tables.r);
+    const __m128i tg = _mm_loadu_si128((const __m128i *)tables.g);
+    const __m128i tb = _mm_loadu_si128((const __m128i *)tables.b);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    unsigned int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)(indexes + i)), low);
+        StoreRGB16(_mm_shuffle_epi8(tr, idx), _mm_shuffle_epi8(tg, idx), _mm_shuffle_epi8(tb, idx), out + (i * 3));
+    }
+    ExpandRGBScalar(indexes + i, count - i, tables, out + (i * 3));
+}
+
+CDG_TARGET("ssse3")
+static void ExpandRGBXSSSE3(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    const __m128i tr = _mm_loadu_si128((const __m128i *)tables.r);
+    const __m128i tg = _mm_loadu_si128((const __m128i *)tables.g);
+    const __m128i tb = _mm_loadu_si128((const __m128i *)tables.b);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    const __m128i x = _mm_set1_epi8((char)0xFF);
+    unsigned int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)(indexes + i)), low);
+        __m128i r = _mm_shuffle_epi8(tr, idx);
+        __m128i g = _mm_shuffle_epi8(tg, idx);
+        __m128i b = _mm_shuffle_epi8(tb, idx);
+        __m128i rgLo = _mm_unpacklo_epi8(r, g);
+        __m128i rgHi = _mm_unpackhi_epi8(r, g);
+        __m128i bxLo = _mm_unpacklo_epi8(b, x);
+        __m128i bxHi = _mm_unpackhi_epi8(b, x);
+        unsigned char *dst = out + (i * 4);
+        _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rgLo, bxLo));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rgLo, bxLo));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(rgHi, bxHi));
+        _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(rgHi, bxHi));
+    }
+    ExpandRGBXScalar(indexes + i, count - i, tables, out + (i * 4));
+}
+
+// The AVX2 kernels work on 32 pixels at a time.  Byte shuffles and unpacks stay within each 128 bit lane,
+// so each lane produces the output for 16 pixels and the lanes are reordered on the way out.
+CDG_TARGET("avx2")
+static void ExpandRGBAVX2(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    const __m256i tr = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.r));
+    const __m256i tg = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.g));
+    const __m256i tb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.b));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i r0 = _mm256_setr_epi8(0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5,
+                                        0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5);
+    const __m256i g0 = _mm256_setr_epi8(-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128,
+                                        -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128);
+    const __m256i b0 = _mm256_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128,
+                                        -128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128);
+    const __m256i r1 = _mm256_setr_epi8(-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128,
+                                        -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128);
+    const __m256i g1 = _mm256_setr_epi8(5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10,
+                                        5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10);
+    const __m256i b1 = _mm256_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128,
+                                        -128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128);
+    const __m256i r2 = _mm256_setr_epi8(-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128,
+                                        -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128);
+    const __m256i g2 = _mm256_setr_epi8(-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128,
+                                        -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128);
+    const __m256i b2 = _mm256_setr_epi8(10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15,
+                                        10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15);
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(indexes + i)), low);
+        __m256i r = _mm256_shuffle_epi8(tr, idx);
+        __m256i g = _mm256_shuffle_epi8(tg, idx);
+        __m256i b = _mm256_shuffle_epi8(tb, idx);
+        __m256i o0 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r0), _mm256_shuffle_epi8(g, g0)), _mm256_shuffle_epi8(b, b0));
+        __m256i o1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r1), _mm256_shuffle_epi8(g, g1)), _mm256_shuffle_epi8(b, b1));
+        __m256i o2 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r2), _mm256_shuffle_epi8(g, g2)), _mm256_shuffle_epi8(b, b2));
+        unsigned char *dst = out + (i * 3);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(o2, o0, 0x30));
+        _mm256_storeu_si256((__m256i *)(dst + 64), _mm256_permute2x128_si256(o1, o2, 0x31));
+    }
+    ExpandRGBSSSE3(indexes + i, count - i, tables, out + (i * 3));
+}
+
+CDG_TARGET("avx2")
+static void ExpandRGBXAVX2(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    const __m256i tr = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.r));
+    const __m256i tg = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.g));
+    const __m256i tb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.b));
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    const __m256i x = _mm256_set1_epi8((char)0xFF);
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(indexes + i)), low);
+        __m256i r = _mm256_shuffle_epi8(tr, idx);
+        __m256i g = _mm256_shuffle_epi8(tg, idx);
+        __m256i b = _mm256_shuffle_epi8(tb, idx);
+        __m256i rgLo = _mm256_unpacklo_epi8(r, g);
+        __m256i rgHi = _mm256_unpackhi_epi8(r, g);
+        __m256i bxLo = _mm256_unpacklo_epi8(b, x);
+        __m256i bxHi = _mm256_unpackhi_epi8(b, x);
+        // Pixels 0-3|16-19, 4-7|20-23, 8-11|24-27 and 12-15|28-31
+        __m256i p0 = _mm256_unpacklo_epi16(rgLo, bxLo);
+        __m256i p1 = _mm256_unpackhi_epi16(rgLo, bxLo);
+        __m256i p2 = _mm256_unpacklo_epi16(rgHi, bxHi);
+        __m256i p3 = _mm256_unpackhi_epi16(rgHi, bxHi);
+        unsigned char *dst = out + (i * 4);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 64), _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256((__m256i *)(dst + 96), _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+    ExpandRGBXSSSE3(indexes + i, count - i, tables, out + (i * 4));
+}
+
+static void DetectCpu(bool &ssse3, bool &avx2)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    ssse3 = ((info[2] & (1 << 9)) != 0);
+    bool osxsave = ((info[2] & (1 << 27)) != 0);
+    bool avx = ((info[2] & (1 << 28)) != 0);
+    avx2 = false;
+    // AVX registers are only usable if the OS saves them on context switch
+    if ((maxLeaf >= 7) && osxsave && avx && ((_xgetbv(0) & 0x06) == 0x06))
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = ((info[1] & (1 << 5)) != 0);
+    }
+#else
+    __builtin_cpu_init();
+    ssse3 = __builtin_cpu_supports("ssse3");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // CDG_EXPAND_X86
+
+static CDG_Expand_Kernels SelectKernels()
+{
+    CDG_Expand_Kernels kernels;
+    kernels.rgb = ExpandRGBScalar;
+    kernels.rgbx = ExpandRGBXScalar;
+    kernels.name = "scalar";
+#ifdef CDG_EXPAND_X86
+    bool ssse3, avx2;
+    DetectCpu(ssse3, avx2);
+    if (avx2)
+    {
+        kernels.rgb = ExpandRGBAVX2;
+        kernels.rgbx = ExpandRGBXAVX2;
+        kernels.name = "avx2";
+    }
+    else if (ssse3)
+    {
+        kernels.rgb = ExpandRGBSSSE3;
+        kernels.rgbx = ExpandRGBXSSSE3;
+        kernels.name = "ssse3";
+    }
+#endif
+    return kernels;
+}
+
+static const CDG_Expand_Kernels &Kernels()
+{
+    static const CDG_Expand_Kernels kernels = SelectKernels();
+    return kernels;
+}
+
+void CDG_Expand_RGB(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    Kernels().rgb(indexes, count, tables, out);
+}
+
+void CDG_Expand_RGBX(const unsigned char *indexes, unsigned int count, const CDG_Palette_Tables &tables, unsigned char *out)
+{
+    Kernels().rgbx(indexes, count, tables, out);
+}
+
+const char *CDG_Expand_Kernel()
+{
+    return Kernels().name;
+}
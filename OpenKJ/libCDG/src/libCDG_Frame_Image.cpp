@@ -48,57 +48,51 @@ unsigned char *CDG_Frame_Image::Get_RGB_Data()
 {
     void *ptr;
     unsigned char *imgdata;
-    unsigned int row;
     ptr = malloc(194400 * sizeof(unsigned char));
     imgdata = (unsigned char *)ptr;
-	for (unsigned int y=0; y<216; y++)
-	{
-		row = y*900;
-		for (unsigned int x=0; x<300; x++)
-		{
-			memcpy(imgdata + ((x*3) + row), &colors[CDG_Map[y][x]].rgb , 3);
-		}
-	}
+    Get_RGB_Data(imgdata);
 	return imgdata;
 };
 
-unsigned char *CDG_Frame_Image::Get_Row_Data(int cdgrow)
+void CDG_Frame_Image::Get_RGB_Data(unsigned char * pRGB)
 {
-    int rowstart = cdgrow * 12;
-    void *ptr;
-    unsigned char *rowdata;
-    unsigned int row;
-    ptr = malloc(10800 * sizeof (unsigned char));
-    rowdata = (unsigned char *)ptr;
-    for (unsigned int y=0; y<12; y++)
-    {
-        row = y*900;
-        for (unsigned int x=0; x<300; x++)
-        {
-            memcpy(rowdata + ((x*3) + row), &colors[CDG_Map[y + rowstart][x]].rgb, 3);
-        }
-    }
-    return rowdata;
+    CDG_Palette_Tables tables;
+    CDG_Build_Palette_Tables(colors, tables);
+    CDG_Expand_RGB(&CDG_Map[0][0], 64800, tables, pRGB);
 }
 
-void CDG_Frame_Image::Get_RGB_Data(unsigned char * pRGB)
+void CDG_Frame_Image::Get_RGBX_Data(unsigned char * pRGBX)
 {
-	unsigned int row;
-	for (unsigned int y=0; y<216; y++)
-	{
-		row = y*900;
-		for (unsigned int x=0; x<300; x++)
-		{
-			memcpy(pRGB + ((x*3) + row), &colors[CDG_Map[y][x]].rgb , 3);
-		}
-	}
+    CDG_Palette_Tables tables;
+    CDG_Build_Palette_Tables(colors, tables);
+    CDG_Expand_RGBX(&CDG_Map[0][0], 64800, tables, pRGBX);
 }
 
-bool CDG_Frame_Image::RowChanged(int row) {
-    bool ret = false;
-    for (unsigned int i=0; i < ChangedRows.size(); i++)
-    {
-        if (row == ChangedRows.at(i)) ret = true;
-    }
-    return ret;
+void CDG_Frame_Image::Get_RGB_Rect(int x, int y, int w, int h, unsigned char * pRGB, int bytesPerLine)
+{
+    CDG_Palette_Tables tables;
+    CDG_Build_Palette_Tables(colors, tables);
+    for (int row = y; row < y + h; row++)
+        CDG_Expand_RGB(&CDG_Map[row][x], w, tables, pRGB + (row * bytesPerLine) + (x * 3));
+}
+
+void CDG_Frame_Image::Get_RGBX_Rect(int x, int y, int w, int h, unsigned char * pRGBX, int bytesPerLine)
+{
+    CDG_Palette_Tables tables;
+    CDG_Build_Palette_Tables(colors, tables);
+    for (int row = y; row < y + h; row++)
+        CDG_Expand_RGBX(&CDG_Map[row][x], w, tables, pRGBX + (row * bytesPerLine) + (x * 4));
+}
+
+void CDG_Frame_Image::Get_Index_Rect(int x, int y, int w, int h, unsigned char * pIndex, int bytesPerLine)
+{
+    for (int row = y; row < y + h; row++)
+        memcpy(pIndex + (row * bytesPerLine) + x, &CDG_Map[row][x], w);
+}
+
+void CDG_Frame_Image::Get_Color_Table(unsigned int table[16])
+{
+    // 0xffRRGGBB, same layout as QRgb
+    for (unsigned int i=0; i < 16; i++)
+        table[i] = 0xFF000000 | (colors[i].rgb[0] << 16) | (colors[i].rgb[1] << 8) | colors[i].rgb[2];
 }
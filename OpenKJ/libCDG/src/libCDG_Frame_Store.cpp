@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of libCDG.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/libCDG_Frame_Store.h"
+#include <algorithm>
+
+// Record layout in m_data:
+//   flags (1 byte), tile count (2 bytes, little endian)
+//   palette (48 bytes RGB) if CDG_RECORD_PALETTE is set
+//   keyframe: packed map (32400 bytes), then tile count * tile index (2 bytes) of the tiles touched since the last frame
+//   delta:    tile count * (tile index (2 bytes), packed tile (36 bytes))
+#define CDG_PACKED_MAP_SIZE  32400
+#define CDG_PACKED_TILE_SIZE    36
+
+CDG_Frame_Store::CDG_Frame_Store()
+{
+    m_work = new CDG_Frame_Image();
+    m_workRecord = -1;
+    m_recordsSinceKeyframe = 0;
+}
+
+CDG_Frame_Store::~CDG_Frame_Store()
+{
+    delete m_work;
+}
+
+void CDG_Frame_Store::Clear()
+{
+    // swap with empty vectors so the memory is actually released
+    std::vector<unsigned char>().swap(m_data);
+    std::vector<unsigned int>().swap(m_recordOffsets);
+    std::vector<unsigned int>().swap(m_recordKeyframes);
+    std::vector<unsigned int>().swap(m_frameRecords);
+    m_recordsSinceKeyframe = 0;
+    m_workRecord = -1;
+}
+
+void CDG_Frame_Store::Append(CDG_Frame_Store &other)
+{
+    if (other.m_frameRecords.empty())
+        return;
+    unsigned int dataOffset = m_data.size();
+    unsigned int recordOffset = m_recordOffsets.size();
+    m_data.insert(m_data.end(), other.m_data.begin(), other.m_data.end());
+    for (unsigned int i=0; i < other.m_recordOffsets.size(); i++)
+    {
+        m_recordOffsets.push_back(other.m_recordOffsets[i] + dataOffset);
+        m_recordKeyframes.push_back(other.m_recordKeyframes[i] + recordOffset);
+    }
+    for (unsigned int i=0; i < other.m_frameRecords.size(); i++)
+        m_frameRecords.push_back(other.m_frameRecords[i] + recordOffset);
+    for (unsigned int i=0; i < 16; i++)
+        m_lastColors[i] = other.m_lastColors[i];
+    m_recordsSinceKeyframe = other.m_recordsSinceKeyframe;
+    other.Clear();
+}
+
+void CDG_Frame_Store::AddFrame(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, bool fullUpdate, bool changed)
+{
+    if ((!changed) && (!m_recordOffsets.empty()))
+    {
+        m_frameRecords.push_back(m_recordOffsets.size() - 1);
+        return;
+    }
+    unsigned char flags = 0;
+    if (fullUpdate)
+        flags |= CDG_RECORD_FULLUPDATE;
+    for (unsigned int i=0; i < 16; i++)
+    {
+        if (m_lastColors[i] != colors[i])
+        {
+            flags |= CDG_RECORD_PALETTE;
+            break;
+        }
+    }
+    unsigned int tileCount = dirtyTiles.count();
+    unsigned int deltaSize = 3 + (tileCount * (2 + CDG_PACKED_TILE_SIZE));
+    m_recordOffsets.push_back(m_data.size());
+    if ((m_recordKeyframes.empty()) || (m_recordsSinceKeyframe >= CDG_KEYFRAME_INTERVAL) || (deltaSize >= CDG_PACKED_MAP_SIZE))
+    {
+        m_recordKeyframes.push_back(m_recordOffsets.size() - 1);
+        m_recordsSinceKeyframe = 0;
+        WriteKeyframe(image, colors, dirtyTiles, tileCount, flags | CDG_RECORD_KEYFRAME | CDG_RECORD_PALETTE);
+    }
+    else
+    {
+        m_recordKeyframes.push_back(m_recordKeyframes.back());
+        m_recordsSinceKeyframe++;
+        WriteDelta(image, colors, dirtyTiles, tileCount, flags);
+    }
+    for (unsigned int i=0; i < 16; i++)
+        m_lastColors[i] = colors[i];
+    m_frameRecords.push_back(m_recordOffsets.size() - 1);
+}
+
+void CDG_Frame_Store::WritePalette(const CDG_Color colors[16])
+{
+    for (unsigned int i=0; i < 16; i++)
+        m_data.insert(m_data.end(), colors[i].rgb, colors[i].rgb + 3);
+}
+
+void CDG_Frame_Store::WriteKeyframe(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, unsigned int tileCount, unsigned char flags)
+{
+    m_data.push_back(flags);
+    m_data.push_back(tileCount & 0xFF);
+    m_data.push_back(tileCount >> 8);
+    WritePalette(colors);
+    size_t pos = m_data.size();
+    m_data.resize(pos + CDG_PACKED_MAP_SIZE + (tileCount * 2));
+    unsigned char *out = &m_data[pos];
+    for (unsigned int y=0; y < 216; y++)
+    {
+        for (unsigned int x=0; x < 300; x += 2)
+            *out++ = image->CDG_Map[y][x] | (image->CDG_Map[y][x + 1] << 4);
+    }
+    // Keep the list of touched tiles so dirty regions don't have to treat every keyframe as a full redraw
+    for (unsigned int tile=0; tile < CDG_TILE_COUNT; tile++)
+    {
+        if (!dirtyTiles.test(tile))
+            continue;
+        *out++ = tile & 0xFF;
+        *out++ = tile >> 8;
+    }
+}
+
+void CDG_Frame_Store::WriteDelta(const CDG_Frame_Image *image, const CDG_Color colors[16], const CDG_Tile_Bitmap &dirtyTiles, unsigned int tileCount, unsigned char flags)
+{
+    m_data.push_back(flags);
+    m_data.push_back(tileCount & 0xFF);
+    m_data.push_back(tileCount >> 8);
+    if (flags & CDG_RECORD_PALETTE)
+        WritePalette(colors);
+    size_t pos = m_data.size();
+    m_data.resize(pos + (tileCount * (2 + CDG_PACKED_TILE_SIZE)));
+    unsigned char *out = &m_data[pos];
+    for (unsigned int tile=0; tile < CDG_TILE_COUNT; tile++)
+    {
+        if (!dirtyTiles.test(tile))
+            continue;
+        *out++ = tile & 0xFF;
+        *out++ = tile >> 8;
+        unsigned int top = (tile / CDG_TILE_COLS) * CDG_TILE_HEIGHT;
+        unsigned int left = (tile % CDG_TILE_COLS) * CDG_TILE_WIDTH;
+        for (unsigned int y = top; y < top + CDG_TILE_HEIGHT; y++)
+        {
+            for (unsigned int x = left; x < left + CDG_TILE_WIDTH; x += 2)
+                *out++ = image->CDG_Map[y][x] | (image->CDG_Map[y][x + 1] << 4);
+        }
+    }
+}
+
+void CDG_Frame_Store::ApplyRecord(unsigned int record)
+{
+    const unsigned char *in = &m_data[m_recordOffsets.at(record)];
+    unsigned char flags = in[0];
+    unsigned int tileCount = in[1] | (in[2] << 8);
+    in += 3;
+    if (flags & CDG_RECORD_PALETTE)
+    {
+        for (unsigned int i=0; i < 16; i++)
+        {
+            m_work->colors[i].SetRGB(in[0], in[1], in[2]);
+            in += 3;
+        }
+    }
+    m_work->NeedFullUpdate = ((flags & CDG_RECORD_FULLUPDATE) != 0);
+    if (flags & CDG_RECORD_KEYFRAME)
+    {
+        for (unsigned int y=0; y < 216; y++)
+        {
+            for (unsigned int x=0; x < 300; x += 2)
+            {
+                m_work->CDG_Map[y][x] = *in & 0x0F;
+                m_work->CDG_Map[y][x + 1] = *in++ >> 4;
+            }
+        }
+        return;
+    }
+    for (unsigned int t=0; t < tileCount; t++)
+    {
+        unsigned int tile = in[0] | (in[1] << 8);
+        in += 2;
+        unsigned int top = (tile / CDG_TILE_COLS) * CDG_TILE_HEIGHT;
+        unsigned int left = (tile % CDG_TILE_COLS) * CDG_TILE_WIDTH;
+        for (unsigned int y = top; y < top + CDG_TILE_HEIGHT; y++)
+        {
+            for (unsigned int x = left; x < left + CDG_TILE_WIDTH; x += 2)
+            {
+                m_work->CDG_Map[y][x] = *in & 0x0F;
+                m_work->CDG_Map[y][x + 1] = *in++ >> 4;
+            }
+        }
+    }
+}
+
+bool CDG_Frame_Store::IsDuplicate(unsigned int frame) const
+{
+    if ((frame == 0) || (frame >= m_frameRecords.size()))
+        return false;
+    return (m_frameRecords[frame] == m_frameRecords[frame - 1]);
+}
+
+unsigned int CDG_Frame_Store::RecordForFrame(unsigned int frame) const
+{
+    if (m_frameRecords.empty())
+        return 0;
+    if (frame >= m_frameRecords.size())
+        frame = m_frameRecords.size() - 1;
+    return m_frameRecords[frame];
+}
+
+bool CDG_Frame_Store::DirtyTiles(unsigned int fromFrame, unsigned int toFrame, CDG_Tile_Bitmap &tiles, bool pixelsOnly) const
+{
+    if (m_frameRecords.empty())
+        return false;
+    if (fromFrame >= m_frameRecords.size())
+        fromFrame = m_frameRecords.size() - 1;
+    if (toFrame >= m_frameRecords.size())
+        toFrame = m_frameRecords.size() - 1;
+    unsigned int first = m_frameRecords[fromFrame];
+    unsigned int last = m_frameRecords[toFrame];
+    if (first > last)
+        std::swap(first, last);
+    // The state at the earlier record is common to both frames, only the records after it can differ
+    for (unsigned int r = first + 1; r <= last; r++)
+    {
+        const unsigned char *in = &m_data[m_recordOffsets[r]];
+        unsigned char flags = in[0];
+        unsigned int tileCount = in[1] | (in[2] << 8);
+        // Presets mark every tile as touched, so the full update flag only adds palette changes on top of the tile list
+        if ((flags & CDG_RECORD_FULLUPDATE) && (!pixelsOnly))
+        {
+            tiles.set();
+            return true;
+        }
+        in += 3;
+        if (flags & CDG_RECORD_PALETTE)
+            in += 48;
+        if (flags & CDG_RECORD_KEYFRAME)
+            in += CDG_PACKED_MAP_SIZE;
+        for (unsigned int t=0; t < tileCount; t++)
+        {
+            tiles.set(in[0] | (in[1] << 8));
+            in += 2;
+            if (!(flags & CDG_RECORD_KEYFRAME))
+                in += CDG_PACKED_TILE_SIZE;
+        }
+    }
+    return tiles.all();
+}
+
+bool CDG_Frame_Store::NeedFullUpdate(unsigned int frame) const
+{
+    if (frame >= m_frameRecords.size())
+        return false;
+    return ((m_data[m_recordOffsets[m_frameRecords[frame]]] & CDG_RECORD_FULLUPDATE) != 0);
+}
+
+CDG_Frame_Image *CDG_Frame_Store::GetFrame(unsigned int frame)
+{
+    if (m_frameRecords.empty())
+        return m_work;
+    if (frame >= m_frameRecords.size())
+        frame = m_frameRecords.size() - 1;
+    int record = m_frameRecords[frame];
+    int keyframe = m_recordKeyframes[record];
+    // Roll forward from the frame we already have if it's based on the same keyframe, otherwise start at the keyframe
+    int start = keyframe;
+    if ((m_workRecord >= keyframe) && (m_workRecord <= record))
+        start = m_workRecord + 1;
+    for (int r = start; r <= record; r++)
+        ApplyRecord(r);
+    m_workRecord = record;
+    return m_work;
+}
+
+// Serialized header: magic (8 bytes), then version, byte order mark, record count, frame count, data size,
+// records since keyframe, as 32 bit integers.  Followed by the palette of the last record (48 bytes).
+#define CDG_TIMELINE_HEADER_SIZE (8 + (6 * 4) + 48)
+#define CDG_TIMELINE_BYTE_ORDER  0x01020304
+
+size_t CDG_Frame_Store::SerializedSize() const
+{
+    return CDG_TIMELINE_HEADER_SIZE + (((m_recordOffsets.size() * 2) + m_frameRecords.size()) * 4) + m_data.size();
+}
+
+void CDG_Frame_Store::Serialize(unsigned char *out) const
+{
+    unsigned int header[6];
+    header[0] = CDG_TIMELINE_VERSION;
+    header[1] = CDG_TIMELINE_BYTE_ORDER;
+    header[2] = m_recordOffsets.size();
+    header[3] = m_frameRecords.size();
+    header[4] = m_data.size();
+    header[5] = m_recordsSinceKeyframe;
+    memset(out, 0, 8);
+    memcpy(out, CDG_TIMELINE_MAGIC, strlen(CDG_TIMELINE_MAGIC));
+    out += 8;
+    memcpy(out, header, sizeof(header));
+    out += sizeof(header);
+    for (unsigned int i=0; i < 16; i++)
+    {
+        memcpy(out, m_lastColors[i].rgb, 3);
+        out += 3;
+    }
+    if (!m_recordOffsets.empty())
+    {
+        memcpy(out, &m_recordOffsets[0], m_recordOffsets.size() * 4);
+        out += m_recordOffsets.size() * 4;
+        memcpy(out, &m_recordKeyframes[0], m_recordKeyframes.size() * 4);
+        out += m_recordKeyframes.size() * 4;
+    }
+    if (!m_frameRecords.empty())
+    {
+        memcpy(out, &m_frameRecords[0], m_frameRecords.size() * 4);
+        out += m_frameRecords.size() * 4;
+    }
+    if (!m_data.empty())
+        memcpy(out, &m_data[0], m_data.size());
+}
+
+bool CDG_Frame_Store::Deserialize(const unsigned char *in, size_t size)
+{
+    Clear();
+    if ((size < CDG_TIMELINE_HEADER_SIZE) || (memcmp(in, CDG_TIMELINE_MAGIC, strlen(CDG_TIMELINE_MAGIC)) != 0))
+        return false;
+    unsigned int header[6];
+    memcpy(header, in + 8, sizeof(header));
+    if ((header[0] != CDG_TIMELINE_VERSION) || (header[1] != CDG_TIMELINE_BYTE_ORDER))
+        return false;
+    size_t records = header[2];
+    size_t frames = header[3];
+    size_t dataSize = header[4];
+    if (size != CDG_TIMELINE_HEADER_SIZE + (((records * 2) + frames) * 4) + dataSize)
+        return false;
+    const unsigned char *p = in + 8 + sizeof(header);
+    for (unsigned int i=0; i < 16; i++)
+    {
+        m_lastColors[i].SetRGB(p[0], p[1], p[2]);
+        p += 3;
+    }
+    m_recordOffsets.resize(records);
+    m_recordKeyframes.resize(records);
+    m_frameRecords.resize(frames);
+    m_data.resize(dataSize);
+    if (records > 0)
+    {
+        memcpy(&m_recordOffsets[0], p, records * 4);
+        p += records * 4;
+        memcpy(&m_recordKeyframes[0], p, records * 4);
+        p += records * 4;
+    }
+    if (frames > 0)
+    {
+        memcpy(&m_frameRecords[0], p, frames * 4);
+        p += frames * 4;
+    }
+    if (dataSize > 0)
+        memcpy(&m_data[0], p, dataSize);
+    m_recordsSinceKeyframe = header[5];
+    // Walk every record once before trusting the data.  ApplyRecord() and DirtyTiles() don't do any bounds checking.
+    bool valid = true;
+    for (size_t i=0; (i < records) && (valid); i++)
+    {
+        size_t offset = m_recordOffsets[i];
+        if ((offset + 3 > dataSize) || (m_recordKeyframes[i] > i))
+        {
+            valid = false;
+            break;
+        }
+        const unsigned char *record = &m_data[offset];
+        unsigned char flags = record[0];
+        size_t tileCount = record[1] | (record[2] << 8);
+        size_t tileSize = (flags & CDG_RECORD_KEYFRAME) ? 2 : 2 + CDG_PACKED_TILE_SIZE;
+        size_t tilesOffset = 3;
+        if (flags & CDG_RECORD_PALETTE)
+            tilesOffset += 48;
+        if (flags & CDG_RECORD_KEYFRAME)
+            tilesOffset += CDG_PACKED_MAP_SIZE;
+        // Records are checked in order, so the keyframe's own offset has already been checked
+        unsigned char keyframeFlags = (m_recordKeyframes[i] == i) ? flags : m_data[m_recordOffsets[m_recordKeyframes[i]]];
+        if ((tileCount > CDG_TILE_COUNT) || (offset + tilesOffset + (tileCount * tileSize) > dataSize) || (!(keyframeFlags & CDG_RECORD_KEYFRAME)))
+        {
+            valid = false;
+            break;
+        }
+        for (size_t t=0; (t < tileCount) && (valid); t++)
+        {
+            const unsigned char *tile = record + tilesOffset + (t * tileSize);
+            if ((tile[0] | (tile[1] << 8)) >= CDG_TILE_COUNT)
+                valid = false;
+        }
+    }
+    for (size_t i=0; (i < frames) && (valid); i++)
+    {
+        if (m_frameRecords[i] >= records)
+            valid = false;
+    }
+    if (!valid)
+        Clear();
+    return valid;
+}
+
+size_t CDG_Frame_Store::MemoryUsage() const
+{
+    return m_data.capacity() + ((m_recordOffsets.capacity() + m_recordKeyframes.capacity() + m_frameRecords.capacity()) * sizeof(unsigned int));
+}
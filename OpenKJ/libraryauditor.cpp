@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "libraryauditor.h"
+#include "okarchive.h"
+#include "settings.h"
+#include "siblingindex.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QSqlQuery>
+#include <QThread>
+#include <QtConcurrent>
+
+#define AUDIT_COMMIT_INTERVAL 250
+#define CDG_PACKET_SIZE 24
+
+extern Settings *settings;
+
+LibraryAuditor::LibraryAuditor(QObject *parent) : QObject(parent)
+{
+    // The audit is mostly waiting on the disk, more threads than this just make a spinning drive or a NAS seek
+    pool.setMaxThreadCount(qBound(2, QThread::idealThreadCount(), 8));
+    stopping = 0;
+    activeWorkers = 0;
+    running = false;
+    runStarted = 0;
+    total = 0;
+    checked = 0;
+    failed = 0;
+    connect(this, SIGNAL(fileAudited(QString,qint64,qint64,bool,QString)), this, SLOT(storeResult(QString,qint64,qint64,bool,QString)), Qt::QueuedConnection);
+    connect(this, SIGNAL(workersFinished()), this, SLOT(auditFinished()), Qt::QueuedConnection);
+}
+
+LibraryAuditor::~LibraryAuditor()
+{
+    stopping = 1;
+    pool.waitForDone();
+    commitResults();
+}
+
+bool LibraryAuditor::canResume()
+{
+    return (settings->auditRunStarted() > 0);
+}
+
+void LibraryAuditor::start(bool resume)
+{
+    if (running)
+        return;
+    if ((resume) && (canResume()))
+        runStarted = settings->auditRunStarted();
+    else
+    {
+        runStarted = QDateTime::currentMSecsSinceEpoch();
+        settings->setAuditRunStarted(runStarted);
+    }
+    QSqlQuery query;
+    query.exec("DELETE FROM songAudit WHERE path NOT IN (SELECT path FROM dbsongs)");
+    // Anything checked since the run started is done, which is what lets an interrupted audit pick up where it left off
+    query.prepare("SELECT dbsongs.path FROM dbsongs LEFT JOIN songAudit ON songAudit.path = dbsongs.path WHERE songAudit.checked IS NULL OR songAudit.checked < :started");
+    query.bindValue(":started", runStarted);
+    query.exec();
+    mutex.lock();
+    queue.clear();
+    while (query.next())
+        queue.append(query.value(0).toString());
+    total = queue.size();
+    mutex.unlock();
+    checked = 0;
+    failed = 0;
+    stopping = 0;
+    running = true;
+    qWarning() << "LibraryAuditor - Checking " << total << " songs using " << pool.maxThreadCount() << " threads";
+    emit progressMaxChanged(total);
+    emit progressChanged(0);
+    emit stateChanged("Verifying karaoke files...");
+    if (total == 0)
+    {
+        auditFinished();
+        return;
+    }
+    int workers = qMin(pool.maxThreadCount(), total);
+    activeWorkers = workers;
+    for (int i=0; i < workers; i++)
+        QtConcurrent::run(&pool, this, &LibraryAuditor::auditWorker);
+}
+
+void LibraryAuditor::cancel()
+{
+    stopping = 1;
+}
+
+bool LibraryAuditor::isRunning()
+{
+    return running;
+}
+
+QStringList LibraryAuditor::failures()
+{
+    QStringList files;
+    QSqlQuery query;
+    query.exec("SELECT path, error FROM songAudit WHERE ok = 0 ORDER BY path");
+    while (query.next())
+        files.append(query.value("error").toString() + ": " + query.value("path").toString());
+    return files;
+}
+
+void LibraryAuditor::storeResult(QString path, qint64 size, qint64 mtime, bool ok, QString error)
+{
+    resultPaths.append(path);
+    resultSizes.append(size);
+    resultMtimes.append(mtime);
+    resultOk.append(ok);
+    resultErrors.append(error);
+    resultChecked.append(QDateTime::currentMSecsSinceEpoch());
+    checked++;
+    if (!ok)
+    {
+        failed++;
+        qWarning() << "LibraryAuditor - " << error << ": " << path;
+    }
+    if (resultPaths.size() >= AUDIT_COMMIT_INTERVAL)
+        commitResults();
+    emit progressChanged(checked);
+    emit stateChanged("Verifying karaoke files... " + QString::number(checked) + " of " + QString::number(total) + ", " + QString::number(failed) + " failed");
+}
+
+void LibraryAuditor::auditFinished()
+{
+    commitResults();
+    running = false;
+    if (!stopping)
+        settings->setAuditRunStarted(0);
+    qWarning() << "LibraryAuditor - " << (stopping ? "Stopped" : "Finished") << " after checking " << checked << " songs, " << failed << " failed";
+    emit finished(checked, failed);
+}
+
+void LibraryAuditor::auditWorker()
+{
+    forever
+    {
+        mutex.lock();
+        if ((stopping) || (queue.isEmpty()))
+        {
+            mutex.unlock();
+            break;
+        }
+        QString path = queue.takeFirst();
+        mutex.unlock();
+        QString error;
+        bool ok = auditFile(path, error);
+        QFileInfo file(path);
+        emit fileAudited(path, file.size(), file.lastModified().toMSecsSinceEpoch(), ok, error);
+    }
+    if (!activeWorkers.deref())
+        emit workersFinished();
+}
+
+bool LibraryAuditor::auditFile(QString path, QString &error)
+{
+    QFileInfo file(path);
+    if (!file.exists())
+    {
+        error = "File not found";
+        return false;
+    }
+    if (file.size() == 0)
+    {
+        error = "Zero byte file";
+        return false;
+    }
+    if (path.endsWith(".zip", Qt::CaseInsensitive))
+    {
+        OkArchive archive(path);
+        if (!archive.verify())
+        {
+            error = archive.getLastError();
+            return false;
+        }
+    }
+    else if (path.endsWith(".cdg", Qt::CaseInsensitive))
+    {
+        // Loose files have no checksum to verify against, only the structure can be checked
+        if (file.size() % CDG_PACKET_SIZE != 0)
+        {
+            error = "Truncated CDG file";
+            return false;
+        }
+        QFileInfo audio(SiblingIndex::companion(path, "mp3"));
+        if (audio.filePath().isEmpty())
+        {
+            error = "Audio file not found";
+            return false;
+        }
+        if (audio.size() == 0)
+        {
+            error = "Zero byte audio file";
+            return false;
+        }
+    }
+    return true;
+}
+
+void LibraryAuditor::commitResults()
+{
+    if (resultPaths.isEmpty())
+        return;
+    QSqlQuery query;
+    query.exec("BEGIN TRANSACTION");
+    query.prepare("INSERT OR REPLACE INTO songAudit (path, size, mtime, ok, error, checked) VALUES(:path, :size, :mtime, :ok, :error, :checked)");
+    query.bindValue(":path", resultPaths);
+    query.bindValue(":size", resultSizes);
+    query.bindValue(":mtime", resultMtimes);
+    query.bindValue(":ok", resultOk);
+    query.bindValue(":error", resultErrors);
+    query.bindValue(":checked", resultChecked);
+    query.execBatch();
+    query.exec("COMMIT TRANSACTION");
+    resultPaths.clear();
+    resultSizes.clear();
+    resultMtimes.clear();
+    resultOk.clear();
+    resultErrors.clear();
+    resultChecked.clear();
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBRARYAUDITOR_H
+#define LIBRARYAUDITOR_H
+
+#include <QObject>
+#include <QStringList>
+#include <QMutex>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QVariantList>
+
+// Checks every song in the database for corruption: the CRC of each zip member, CDG files that aren't a whole number
+// of packets, missing or empty audio.  Files are checked on a bounded thread pool and the results go to the songAudit
+// table.  An interrupted audit can be resumed, songs already checked by it are skipped.
+
+class LibraryAuditor : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LibraryAuditor(QObject *parent = 0);
+    ~LibraryAuditor();
+    // Whether the last audit was interrupted before it finished
+    bool canResume();
+    void start(bool resume);
+    void cancel();
+    bool isRunning();
+    // Songs that failed their most recent check, with the reason
+    QStringList failures();
+
+signals:
+    void progressChanged(int progress);
+    void progressMaxChanged(int max);
+    void stateChanged(QString state);
+    void finished(int checked, int failed);
+    void fileAudited(QString path, qint64 size, qint64 mtime, bool ok, QString error);
+    void workersFinished();
+
+private slots:
+    void storeResult(QString path, qint64 size, qint64 mtime, bool ok, QString error);
+    void auditFinished();
+
+private:
+    QThreadPool pool;
+    QMutex mutex;
+    QStringList queue;
+    QAtomicInt stopping;
+    QAtomicInt activeWorkers;
+    bool running;
+    qint64 runStarted;
+    int total;
+    int checked;
+    int failed;
+    // Results waiting to be written, one list per column for QSqlQuery::execBatch()
+    QVariantList resultPaths;
+    QVariantList resultSizes;
+    QVariantList resultMtimes;
+    QVariantList resultOk;
+    QVariantList resultErrors;
+    QVariantList resultChecked;
+    void auditWorker();
+    static bool auditFile(QString path, QString &error);
+    void commitResults();
+};
+
+#endif // LIBRARYAUDITOR_H
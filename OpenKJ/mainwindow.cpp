@@ -40,10 +40,14 @@
 #include "okjsongbookapi.h"
 #include "updatechecker.h"
 #include "okjversion.h"
+#include "cdgcache.h"
+#include "siblingindex.h"
+#include <QtConcurrent>
 
 Settings *settings;
 OKJSongbookAPI *songbookApi;
 KhDb *db;
+CdgCache *cdgCache;
 
 QString MainWindow::GetRandomString() const
 {
@@ -110,6 +114,13 @@ MainWindow::MainWindow(QWidget *parent) :
         khDir->mkpath(khDir->absolutePath());
     }
     settings = new Settings(this);
+    cdgCache = new CdgCache(this);
+    songPrefetcher = new SongPrefetcher(this);
+    cdgCache->setPrefetcher(songPrefetcher);
+    songLoader = new SongLoader(songPrefetcher, this);
+    loadingK2k = false;
+    connect(songLoader, SIGNAL(ready(int)), this, SLOT(songLoader_ready(int)));
+    connect(songLoader, SIGNAL(failed(int,QString)), this, SLOT(songLoader_failed(int,QString)));
     if (settings->theme() != 0)
     {
         ui->pushButtonIncomingRequests->setStyleSheet("");
@@ -119,6 +130,7 @@ MainWindow::MainWindow(QWidget *parent) :
     int initialKVol = settings->audioVolume();
     int initialBMVol = settings->bmVolume();
     qWarning() << "Initial volumes - K: " << initialKVol << " BM: " << initialBMVol;
+    qWarning() << "CDG palette expansion kernel: " << CDG_Expand_Kernel();
     settings->restoreWindowState(this);
     database = QSqlDatabase(QSqlDatabase::addDatabase("QSQLITE"));
     database.setDatabaseName(khDir->absolutePath() + QDir::separator() + "openkj.sqlite");
@@ -164,6 +176,21 @@ MainWindow::MainWindow(QWidget *parent) :
         query.exec("UPDATE dbsongs SET searchstring = filename || ' ' || artist || ' ' || title || ' ' || discid");
         query.exec("PRAGMA user_version = 103");
     }
+    if (schemaVersion < 104)
+    {
+        query.exec("CREATE TABLE IF NOT EXISTS songAudit ( path VARCHAR(700) PRIMARY KEY, size INTEGER, mtime INTEGER, ok LOGICAL, error TEXT, checked INTEGER)");
+        query.exec("PRAGMA user_version = 104");
+    }
+    if (schemaVersion < 105)
+    {
+        query.exec("CREATE TABLE IF NOT EXISTS dirSnapshots ( path VARCHAR(700) PRIMARY KEY, mtime INTEGER, entries INTEGER, inode INTEGER, scanned INTEGER)");
+        query.exec("PRAGMA user_version = 105");
+    }
+    if (schemaVersion < 106)
+    {
+        query.exec("CREATE TABLE IF NOT EXISTS songFingerprints ( songid INTEGER PRIMARY KEY, fingerprint TEXT)");
+        query.exec("PRAGMA user_version = 106");
+    }
 
 //    query.exec("ATTACH DATABASE ':memory:' AS mem");
 //    query.exec("CREATE TABLE mem.dbsongs AS SELECT * FROM main.dbsongs");
@@ -199,6 +226,8 @@ MainWindow::MainWindow(QWidget *parent) :
     dlgSongShop = new DlgSongShop(shop);
     dlgSongShop->setModal(false);
     cdg = new CDG;
+    nextCdg = new CDG;
+    connect(&nextCdgWatcher, SIGNAL(finished()), this, SLOT(nextCdgPrepared()));
     ui->tableViewDB->setModel(dbModel);
     dbDelegate = new DbItemDelegate(this);
     ui->tableViewDB->setItemDelegate(dbDelegate);
@@ -226,6 +255,7 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(rotModel, SIGNAL(songDroppedOnSinger(int,int,int)), this, SLOT(songDroppedOnSinger(int,int,int)));
     connect(kAudioBackend, SIGNAL(volumeChanged(int)), ui->sliderVolume, SLOT(setValue(int)));
     connect(dbDialog, SIGNAL(databaseUpdated()), this, SLOT(songdbUpdated()));
+    connect(dbDialog, SIGNAL(songsAdded()), dbModel, SLOT(refreshSearch()));
     connect(dbDialog, SIGNAL(databaseCleared()), this, SLOT(databaseCleared()));
     connect(dbDialog, SIGNAL(databaseCleared()), regularSingersDialog, SLOT(regularsChanged()));
     connect(kAudioBackend, SIGNAL(positionChanged(qint64)), this, SLOT(audioBackend_positionChanged(qint64)));
@@ -510,6 +540,101 @@ MainWindow::MainWindow(QWidget *parent) :
 
 }
 
+void MainWindow::prepareNextSong(QString karaokeFilePath)
+{
+    // Decodes the next singer's song into nextCdg on a worker thread so play() can swap it in without any decoding
+    if (karaokeFilePath == nextCdgPath)
+    {
+        pendingNextCdgPath.clear();
+        return;
+    }
+    if (nextCdgFuture.isRunning())
+    {
+        pendingNextCdgPath = karaokeFilePath;
+        return;
+    }
+    pendingNextCdgPath.clear();
+    nextCdgPath = karaokeFilePath;
+    nextCdgFuture = QtConcurrent::run(cdgCache, &CdgCache::openFile, nextCdg, karaokeFilePath);
+    nextCdgWatcher.setFuture(nextCdgFuture);
+}
+
+void MainWindow::nextCdgPrepared()
+{
+    if (pendingNextCdgPath.isEmpty())
+        return;
+    QString karaokeFilePath = pendingNextCdgPath;
+    pendingNextCdgPath.clear();
+    prepareNextSong(karaokeFilePath);
+}
+
+bool MainWindow::takePreparedCdg(QString karaokeFilePath)
+{
+    if ((nextCdgPath.isEmpty()) || (karaokeFilePath != nextCdgPath))
+        return false;
+    nextCdgPath.clear();
+    nextCdgFuture.waitForFinished();
+    if (!nextCdgFuture.result())
+        return false;
+    nextCdg->setTempo(cdg->tempo());
+    detachCdgFrames();
+    std::swap(cdg, nextCdg);
+    nextCdg->VideoClose();
+    return true;
+}
+
+void MainWindow::detachCdgFrames()
+{
+    // Both surfaces show the last frame straight out of the current CDG's frame pool, a repaint after it's gone would
+    // read freed memory
+    ui->cdgVideoWidget->videoSurface()->detachCdgFrame();
+    cdgWindow->detachCdgFrame();
+}
+
+void MainWindow::startRecording()
+{
+    if (settings->recordingEnabled())
+    {
+        qWarning() << "Starting recording";
+        QString timeStamp = QDateTime::currentDateTime().toString("yyyy-MM-dd-hhmm");
+        audioRecorder->record(curSinger + " - " + curArtist + " - " + curTitle + " - " + timeStamp);
+    }
+}
+
+void MainWindow::songLoader_ready(int request)
+{
+    if (request != songLoader->currentRequest())
+        return;
+    CDG *loadedCdg = songLoader->takeCdg();
+    if (loadedCdg)
+    {
+        loadedCdg->setTempo(cdg->tempo());
+        detachCdgFrames();
+        delete cdg;
+        cdg = loadedCdg;
+    }
+    QIODevice *audio = songLoader->takeAudioDevice();
+    if (audio)
+    {
+        cdgWindow->setShowBgImage(false);
+        setShowBgImage(false);
+        kAudioBackend->setMedia(audio);
+    }
+    else
+        kAudioBackend->setMedia(songLoader->audioFile());
+    if (!loadingK2k)
+        bmAudioBackend->fadeOut(!settings->bmKCrossFade());
+    kAudioBackend->play();
+    startRecording();
+}
+
+void MainWindow::songLoader_failed(int request, QString message)
+{
+    if (request != songLoader->currentRequest())
+        return;
+    QMessageBox::warning(this, tr("Bad karaoke file"), message, QMessageBox::Ok);
+}
+
 void MainWindow::play(QString karaokeFilePath, bool k2k)
 {
     khTmpDir->remove();
@@ -526,101 +651,21 @@ void MainWindow::play(QString karaokeFilePath, bool k2k)
             }
             kAudioBackend->stop();
         }
-        if (karaokeFilePath.endsWith(".zip", Qt::CaseInsensitive))
-        {
-            OkArchive archive(karaokeFilePath);
-            if ((archive.checkCDG()) && (archive.checkAudio()))
-            {
-                if (archive.checkAudio())
-                {
-                    if (!archive.extractAudio(khTmpDir->path(), "tmp" + archive.audioExtension()))
-                    {
-                        QMessageBox::warning(this, tr("Bad karaoke file"), tr("Failed to extract audio file."),QMessageBox::Ok);
-                        return;
-                    }
-                    cdg->FileOpen(archive.getCDGData());
-                    cdg->Process();
-                    cdgWindow->setShowBgImage(false);
-                    setShowBgImage(false);
-                    kAudioBackend->setMedia(khTmpDir->path() + QDir::separator() + "tmp" + archive.audioExtension());
-                    //                ipcClient->send_MessageToServer(KhIPCClient::CMD_FADE_OUT);
-                    if (!k2k)
-                        bmAudioBackend->fadeOut(!settings->bmKCrossFade());
-                    kAudioBackend->play();
-                }
-            }
-            else
-            {
-                QMessageBox::warning(this, tr("Bad karaoke file"),tr("Zip file does not contain a valid karaoke track.  CDG or audio file missing or corrupt."),QMessageBox::Ok);
-                return;
-            }
-        }
-        else if (karaokeFilePath.endsWith(".cdg", Qt::CaseInsensitive))
+        if ((karaokeFilePath.endsWith(".zip", Qt::CaseInsensitive)) || (karaokeFilePath.endsWith(".cdg", Qt::CaseInsensitive)))
         {
-            static QString prevCdgTmpFile;
-            static QString prevAudioTmpFile;
-            QFile::remove(khTmpDir->path() + QDir::separator() + prevCdgTmpFile);
-            QFile::remove(khTmpDir->path() + QDir::separator() + prevAudioTmpFile);
-            QString tmpString = GetRandomString();
-            QString cdgTmpFile = tmpString + ".cdg";
-            QString audTmpFile = tmpString + ".mp3";
-            prevCdgTmpFile = cdgTmpFile;
-            prevAudioTmpFile = audTmpFile;
-            QFile cdgFile(karaokeFilePath);
-            if (!cdgFile.exists())
-            {
-                QMessageBox::warning(this, tr("Bad karaoke file"), tr("CDG file missing."),QMessageBox::Ok);
-                return;
-            }
-            else if (cdgFile.size() == 0)
-            {
-                QMessageBox::warning(this, tr("Bad karaoke file"), tr("CDG file contains no data"),QMessageBox::Ok);
-                return;
-            }
-            QString mp3fn;
-            QString baseFn = karaokeFilePath;
-            baseFn.chop(3);
-            if (QFile::exists(baseFn + "mp3"))
-                mp3fn = baseFn + "mp3";
-            else if (QFile::exists(baseFn + "Mp3"))
-                mp3fn = baseFn + "Mp3";
-            else if (QFile::exists(baseFn + "MP3"))
-                mp3fn = baseFn + "MP3";
-            else if (QFile::exists(baseFn + "mP3"))
-                mp3fn = baseFn + "mP3";
-            else
-            {
-                QMessageBox::warning(this, tr("Bad karaoke file"), tr("mp3 file missing."),QMessageBox::Ok);
-                return;
-            }
-            QFile mp3File(mp3fn);
-            if (mp3File.size() == 0)
-            {
-                QMessageBox::warning(this, tr("Bad karaoke file"), tr("mp3 file contains no data"),QMessageBox::Ok);
-                return;
-            }
-            cdgFile.copy(khTmpDir->path() + QDir::separator() + cdgTmpFile);
-            QFile::copy(mp3fn, khTmpDir->path() + QDir::separator() + audTmpFile);
-            cdg->FileOpen(QString(khTmpDir->path() + QDir::separator() + cdgTmpFile).toStdString());
-            cdg->Process();
-            kAudioBackend->setMedia(khTmpDir->path() + QDir::separator() + audTmpFile);
-//            ipcClient->send_MessageToServer(KhIPCClient::CMD_FADE_OUT);
-            if (!k2k)
-                bmAudioBackend->fadeOut(!settings->bmKCrossFade());
-            kAudioBackend->play();
+            // Loaded on a worker thread, playback starts in songLoader_ready()
+            bool haveCdg = ((karaokeFilePath == nextCdgPath) && (nextCdgFuture.isFinished()) && (takePreparedCdg(karaokeFilePath)));
+            loadingK2k = k2k;
+            songLoader->load(karaokeFilePath, khTmpDir->path(), haveCdg);
         }
         else
         {
+            songLoader->cancel();
             kAudioBackend->setMedia(karaokeFilePath);
             if (!k2k)
                 bmAudioBackend->fadeOut();
             kAudioBackend->play();
-        }
-        if (settings->recordingEnabled())
-        {
-            qWarning() << "Starting recording";
-            QString timeStamp = QDateTime::currentDateTime().toString("yyyy-MM-dd-hhmm");
-            audioRecorder->record(curSinger + " - " + curArtist + " - " + curTitle + " - " + timeStamp);
+            startRecording();
         }
     }
     else if (kAudioBackend->state() == AbstractAudioBackend::PausedState)
@@ -657,6 +702,9 @@ MainWindow::~MainWindow()
     settings->saveColumnWidths(ui->tableViewBmPlaylist);
     settings->bmSetPlaylistIndex(ui->comboBoxBmPlaylists->currentIndex());
 
+    delete songLoader;
+    nextCdgFuture.waitForFinished();
+    delete nextCdg;
     delete cdg;
     delete khDir;
     delete ui;
@@ -719,6 +767,7 @@ void MainWindow::on_buttonStop_clicked()
         }
     }
     kAASkip = true;
+    songLoader->cancel();
     cdgWindow->showAlert(false);
     audioRecorder->stop();
     if (settings->bmKCrossFade())
@@ -1096,12 +1145,10 @@ void MainWindow::audioBackend_positionChanged(qint64 position)
     {
         if (cdg->IsOpen() && cdg->GetLastCDGUpdate() >= position)
         {
-                unsigned char* rgbdata;
-                rgbdata = cdg->GetImageByTime(position + cdgOffset);
-                QImage img(rgbdata, 300, 216, QImage::Format_RGB888);
-                ui->cdgVideoWidget->videoSurface()->present(QVideoFrame(img));
-                cdgWindow->updateCDG(img);
-                free(rgbdata);
+                // frame buffer is owned by cdg and stays valid until two more frames have been rendered
+                CDG_Frame_Handle frame = cdg->GetIndexedFrameByTime(position + cdgOffset);
+                ui->cdgVideoWidget->videoSurface()->presentCdgFrame(frame);
+                cdgWindow->updateCDG(frame);
         }
         if (!sliderPositionPressed)
         {
@@ -1127,6 +1174,7 @@ void MainWindow::audioBackend_stateChanged(AbstractAudioBackend::State state)
     {
         qWarning() << "Audio entered StoppedState";
         audioRecorder->stop();
+        detachCdgFrames();
         cdg->VideoClose();
         if (k2kTransition)
             return;
@@ -1237,6 +1285,22 @@ void MainWindow::rotationDataChanged()
     QString statusBarText = "Singers: ";
     statusBarText += QString::number(rotModel->rowCount());
     labelSingerCount->setText(statusBarText);
+    // Decode the upcoming singers' songs in the background so they open straight from the cdg cache
+    QStringList upcoming;
+    int warmPos = -1;
+    if (rotModel->currentSinger() != -1)
+        warmPos = rotModel->getSingerPosition(rotModel->currentSinger());
+    for (int i=0; i < rotModel->rowCount() && upcoming.size() < 10; i++)
+    {
+        warmPos = (warmPos + 1 < rotModel->rowCount()) ? warmPos + 1 : 0;
+        QString path = rotModel->nextSongPath(rotModel->singerIdAtPosition(warmPos));
+        if (path.endsWith(".zip", Qt::CaseInsensitive) || path.endsWith(".cdg", Qt::CaseInsensitive))
+            upcoming << path;
+    }
+    if (!upcoming.isEmpty())
+        prepareNextSong(upcoming.first());
+    cdgCache->warmUp(upcoming);
+    songPrefetcher->setPlan(upcoming.mid(0, settings->songPrefetchCount()));
     QString tickerText;
     if (settings->tickerCustomString() != "")
     {
@@ -2230,13 +2294,7 @@ void MainWindow::filesDroppedOnQueue(QList<QUrl> urls, int singerId, int positio
             }
             else if (file.endsWith(".cdg", Qt::CaseInsensitive))
             {
-                QString noext = file;
-                noext.chop(3);
-                QString mp3_1 = noext + "mp3";
-                QString mp3_2 = noext + "MP3";
-                QString mp3_3 = noext + "Mp3";
-                QString mp3_4 = noext + "mP3";
-                if (!QFile(mp3_1).exists() && !QFile(mp3_2).exists() && !QFile(mp3_3).exists() && !QFile(mp3_4).exists())
+                if (SiblingIndex::companion(file, "mp3").isEmpty())
                 {
                     QMessageBox msgBox;
                     msgBox.setWindowTitle("Invalid karoake file!");
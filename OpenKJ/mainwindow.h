@@ -56,6 +56,10 @@
 #include "bmplitemdelegate.h"
 #include "bmdbdialog.h"
 #include <QThread>
+#include <QFuture>
+#include <QFutureWatcher>
+#include "songprefetcher.h"
+#include "songloader.h"
 #include "audiorecorder.h"
 #include "dlgbookcreator.h"
 #include "dlgeq.h"
@@ -111,6 +115,19 @@ private:
     QTemporaryDir *khTmpDir;
     QDir *khDir;
     CDG *cdg;
+    CDG *nextCdg;
+    SongPrefetcher *songPrefetcher;
+    SongLoader *songLoader;
+    bool loadingK2k;
+    void startRecording();
+    void detachCdgFrames();
+    QString nextCdgPath;
+    QFuture<bool> nextCdgFuture;
+    QFutureWatcher<bool> nextCdgWatcher;
+    // Song asked for while nextCdg was still busy, it's prepared once the running decode is done
+    QString pendingNextCdgPath;
+    void prepareNextSong(QString karaokeFilePath);
+    bool takePreparedCdg(QString karaokeFilePath);
     int sortColDB;
     int sortDirDB;
     QString dbRtClickFile;
@@ -179,6 +196,9 @@ private slots:
     void on_buttonClearQueue_clicked();
     void on_spinBoxKey_valueChanged(int arg1);
     void audioBackend_positionChanged(qint64 position);
+    void songLoader_ready(int request);
+    void nextCdgPrepared();
+    void songLoader_failed(int request, QString message);
     void audioBackend_durationChanged(qint64 duration);
     void audioBackend_stateChanged(AbstractAudioBackend::State state);
     void on_sliderProgress_sliderMoved(int position);
@@ -23,19 +23,80 @@
 #include <QDebug>
 #include <QFile>
 #include <QBuffer>
-#include <QTemporaryDir>
-#ifdef Q_OS_WIN
-#include <io.h>
-#else
-#include <QProcess>
-#include <unistd.h>
-#endif
+#include <QDir>
+#include <QtEndian>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QDateTime>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QThread>
+#include <QThreadStorage>
+#include <QAtomicInt>
+#include <QStandardPaths>
+#include <zlib.h>
 
-QString infoZipPath;
+// Zip record signatures and fixed sizes, see PKWARE's APPNOTE.TXT
+#define ZIP_EOCD_SIGNATURE       0x06054b50
+#define ZIP_CENTRAL_SIGNATURE    0x02014b50
+#define ZIP_LOCAL_SIGNATURE      0x04034b50
+#define ZIP_EOCD_SIZE            22
+#define ZIP_CENTRAL_SIZE         46
+#define ZIP_LOCAL_SIZE           30
+#define ZIP_MAX_COMMENT          65535
+#define ZIP_METHOD_STORED        0
+#define ZIP_METHOD_DEFLATED      8
+#define ZIP_FLAG_ENCRYPTED       0x0001
+#define ZIP_FLAG_UTF8            0x0800
+#define ZIP_INDEX_VERSION        1
+#define CDG_PACKET_SIZE          24
+// Deflate can't do better than about 1032:1, and no karaoke track comes anywhere near this
+#define ZIP_MAX_RATIO            1032
+#define ZIP_MAX_MEMBER_SIZE      (512 * 1024 * 1024)
+
+// The archiveIndex table caches zip directories keyed by path, size and mtime.  It lives in its own database in the
+// cache dir, so it never contends with the long transactions on the main database during a scan.  SQLite connections
+// can't be shared between threads and OkArchive is used from the db update and cache worker threads, so each thread
+// gets its own connection.  It's removed again when the thread exits, pool threads come and go.
+class IndexConnection
+{
+public:
+    IndexConnection(QString connectionName) { name = connectionName; }
+    ~IndexConnection()
+    {
+        QSqlDatabase::database(name, false).close();
+        QSqlDatabase::removeDatabase(name);
+    }
+    QString name;
+};
+
+static QThreadStorage<IndexConnection *> indexConnections;
+static QAtomicInt indexConnectionCount;
+
+static QSqlDatabase indexDatabase()
+{
+    if (indexConnections.hasLocalData())
+        return QSqlDatabase::database(indexConnections.localData()->name);
+    // Numbered rather than named after the thread id, ids get reused once a thread is gone
+    QString name = "okarchive_" + QString::number(indexConnectionCount.fetchAndAddOrdered(1));
+    indexConnections.setLocalData(new IndexConnection(name));
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QDir().mkpath(dir);
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", name);
+    db.setDatabaseName(dir + QDir::separator() + "archiveindex.sqlite");
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=1000");
+    if (db.open())
+    {
+        QSqlQuery query(db);
+        query.exec("PRAGMA journal_mode=WAL");
+        query.exec("PRAGMA synchronous=OFF");
+        query.exec("CREATE TABLE IF NOT EXISTS archiveIndex ( path VARCHAR(700) PRIMARY KEY, size INTEGER, mtime INTEGER, entries BLOB)");
+    }
+    return db;
+}
 
 OkArchive::OkArchive(QString ArchiveFile, QObject *parent) : QObject(parent)
 {
-    process = new QProcess(this);
     archiveFile = ArchiveFile;
     qWarning() << "OkArchive opening file: " << archiveFile;
     m_cdgFound = false;
@@ -53,17 +114,10 @@ OkArchive::OkArchive(QString ArchiveFile, QObject *parent) : QObject(parent)
     audioExtensions.append(".ogg");
     audioExtensions.append(".mov");
     audioExtensions.append(".flac");
-#ifdef Q_OS_WIN
-    infoZipPath = "unzip.exe";
-#else
-    infoZipPath = "/usr/bin/unzip";
-#endif
-
 }
 
 OkArchive::OkArchive(QObject *parent) : QObject(parent)
 {
-    process = new QProcess(this);
     m_cdgFound = false;
     m_audioFound = false;
     m_cdgSize = 0;
@@ -79,11 +133,6 @@ OkArchive::OkArchive(QObject *parent) : QObject(parent)
     audioExtensions.append(".ogg");
     audioExtensions.append(".mov");
     audioExtensions.append(".flac");
-#ifdef Q_OS_WIN
-    infoZipPath = "unzip.exe";
-#else
-    infoZipPath = "/usr/bin/unzip";
-#endif
 }
 
 OkArchive::~OkArchive()
@@ -103,21 +152,28 @@ unsigned int OkArchive::getSongDuration()
 
 QByteArray OkArchive::getCDGData()
 {
-    if (findCDG())
-    {
-        QTemporaryDir dir;
-        if (!extractFile(cdgFileName, dir.path(), "tmp.cdg"))
-            return QByteArray();
-        QByteArray data;
-        QFile cdg(dir.path() + QDir::separator() + "tmp.cdg");
-        cdg.open(QFile::ReadOnly);
-        data = cdg.readAll();
-        cdg.close();
+    // Inflated straight into the buffer handed to libCDG, nothing is written to disk
+    zipEntry entry;
+    QByteArray data;
+    if ((findCDG()) && (findEntry(cdgFileName, entry)) && (readEntry(entry, data)))
         return data;
-    }
     return QByteArray();
 }
 
+QIODevice *OkArchive::openAudio()
+{
+    zipEntry entry;
+    if ((!findAudio()) || (!findEntry(audioFileName, entry)))
+        return NULL;
+    OkArchiveEntryDevice *device = new OkArchiveEntryDevice(archiveFile, entry);
+    if (!device->open(QIODevice::ReadOnly))
+    {
+        delete device;
+        return NULL;
+    }
+    return device;
+}
+
 QString OkArchive::getArchiveFile() const
 {
     return archiveFile;
@@ -136,6 +192,7 @@ void OkArchive::setArchiveFile(const QString &value)
     cdgFileName = "";
     audioExt = "";
     m_entriesProcessed = false;
+    goodArchive = false;
     lastError = "";
 }
 
@@ -279,129 +336,529 @@ zipEntries OkArchive::getZipContents()
 {
     if (m_entriesProcessed)
         return m_entries;
-    QStringList arguments;
-    arguments << "-l";
-    arguments << archiveFile;
-    process->setProcessChannelMode(QProcess::MergedChannels);
-    process->setProgram(infoZipPath);
-    process->setArguments(arguments);
-    process->start(QProcess::ReadOnly);
-    process->waitForFinished();
-    if (process->exitCode() == 0)
-    {
-        // no error
-        goodArchive = true;
-    }
-    else if (process->exitCode() <= 2)
+    m_entriesProcessed = true;
+    goodArchive = false;
+    QFileInfo info(archiveFile);
+    qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+    if (loadIndex(info.size(), mtime))
     {
-        qWarning() << "Non-fatal error while processing zip: " << archiveFile;
-        qWarning() << "infozip returned error code: " << process->exitCode();
         goodArchive = true;
+        return m_entries;
     }
-    else if (process->exitCode() >= 3)
+    QFile zipFile(archiveFile);
+    if (!zipFile.open(QIODevice::ReadOnly))
     {
-        qWarning() << "Fatal error while processing zip: " << archiveFile;
-        qWarning() << "infozip returned error code: " << process->exitCode();
-        goodArchive = false;
+        qWarning() << "Unable to open zip: " << archiveFile;
         return zipEntries();
     }
-    QString output = process->readAll();
-    QStringList data = output.split(QRegExp("[\r\n]"),QString::SkipEmptyParts);
-    int fnStart = 0;
-    int listStart = 0;
-    for (int l=0; l < data.size(); l++)
+    // The end of central directory record is at the very end of the file, followed only by the archive comment
+    qint64 tailSize = qMin(zipFile.size(), (qint64)(ZIP_EOCD_SIZE + ZIP_MAX_COMMENT));
+    zipFile.seek(zipFile.size() - tailSize);
+    QByteArray tail = zipFile.read(tailSize);
+    const uchar *tailData = (const uchar *)tail.constData();
+    int eocd = -1;
+    for (int i = tail.size() - ZIP_EOCD_SIZE; i >= 0; i--)
     {
-        if (data.at(l).contains("Name", Qt::CaseInsensitive) && data.at(l).contains("Length", Qt::CaseInsensitive) && data.at(l).contains("Date", Qt::CaseInsensitive))
+        if (qFromLittleEndian<quint32>(tailData + i) == ZIP_EOCD_SIGNATURE)
         {
-            fnStart = data.at(l).indexOf("Name");
-            listStart = l;
+            eocd = i;
             break;
         }
     }
-    for (int l=0; l < listStart; l++)
-        data.removeFirst();
-    data.removeFirst();
-    data.removeFirst();
-    data.removeLast();
-    data.removeLast();
-    for (int i=0; i < data.size(); i++)
+    if (eocd == -1)
     {
+        qWarning() << "Fatal error while processing zip: " << archiveFile;
+        qWarning() << "End of central directory record not found";
+        return zipEntries();
+    }
+    int entryCount = qFromLittleEndian<quint16>(tailData + eocd + 10);
+    quint32 dirSize = qFromLittleEndian<quint32>(tailData + eocd + 12);
+    quint32 dirOffset = qFromLittleEndian<quint32>(tailData + eocd + 16);
+    if ((dirOffset == 0xFFFFFFFF) || ((qint64)dirOffset + dirSize > zipFile.size()))
+    {
+        qWarning() << "Fatal error while processing zip: " << archiveFile;
+        qWarning() << "Central directory is out of range or zip64, which isn't supported";
+        return zipEntries();
+    }
+    zipFile.seek(dirOffset);
+    QByteArray dir = zipFile.read(dirSize);
+    const uchar *dirData = (const uchar *)dir.constData();
+    int pos = 0;
+    for (int i=0; i < entryCount; i++)
+    {
+        if ((pos + ZIP_CENTRAL_SIZE > dir.size()) || (qFromLittleEndian<quint32>(dirData + pos) != ZIP_CENTRAL_SIGNATURE))
+        {
+            qWarning() << "Fatal error while processing zip: " << archiveFile;
+            qWarning() << "Central directory is truncated or corrupt";
+            m_entries.clear();
+            return zipEntries();
+        }
+        int nameLength = qFromLittleEndian<quint16>(dirData + pos + 28);
+        int extraLength = qFromLittleEndian<quint16>(dirData + pos + 30);
+        int commentLength = qFromLittleEndian<quint16>(dirData + pos + 32);
+        if (pos + ZIP_CENTRAL_SIZE + nameLength > dir.size())
+        {
+            qWarning() << "Fatal error while processing zip: " << archiveFile;
+            qWarning() << "Central directory is truncated or corrupt";
+            m_entries.clear();
+            return zipEntries();
+        }
         zipEntry entry;
-        int fnOffset = data.at(i).size() - fnStart;
-        entry.fileName = data.at(i).right(fnOffset);
-        entry.fileSize = data.at(i).split(" ", QString::SkipEmptyParts).at(0).toInt();
+        entry.flags = qFromLittleEndian<quint16>(dirData + pos + 8);
+        entry.compressionMethod = qFromLittleEndian<quint16>(dirData + pos + 10);
+        entry.crc = qFromLittleEndian<quint32>(dirData + pos + 16);
+        entry.compressedSize = qFromLittleEndian<quint32>(dirData + pos + 20);
+        entry.fileSize = qFromLittleEndian<quint32>(dirData + pos + 24);
+        entry.localHeaderOffset = qFromLittleEndian<quint32>(dirData + pos + 42);
+        const char *name = dir.constData() + pos + ZIP_CENTRAL_SIZE;
+        if (entry.flags & ZIP_FLAG_UTF8)
+            entry.fileName = QString::fromUtf8(name, nameLength);
+        else
+            entry.fileName = QString::fromLocal8Bit(name, nameLength);
         m_entries.append(entry);
+        pos += ZIP_CENTRAL_SIZE + nameLength + extraLength + commentLength;
     }
-    m_entriesProcessed = true;
+    goodArchive = true;
+    saveIndex(info.size(), mtime);
     return m_entries;
 }
 
+bool OkArchive::loadIndex(qint64 size, qint64 mtime)
+{
+    QSqlDatabase db = indexDatabase();
+    if (!db.isOpen())
+        return false;
+    QSqlQuery query(db);
+    query.prepare("SELECT entries FROM archiveIndex WHERE path = :path AND size = :size AND mtime = :mtime");
+    query.bindValue(":path", archiveFile);
+    query.bindValue(":size", size);
+    query.bindValue(":mtime", mtime);
+    if ((!query.exec()) || (!query.first()))
+        return false;
+    QByteArray blob = query.value(0).toByteArray();
+    QDataStream stream(blob);
+    quint32 version, count;
+    stream >> version >> count;
+    if (version != ZIP_INDEX_VERSION)
+        return false;
+    m_entries.clear();
+    for (quint32 i=0; i < count; i++)
+    {
+        zipEntry entry;
+        stream >> entry.fileName >> entry.fileSize >> entry.compressedSize >> entry.compressionMethod >> entry.flags >> entry.crc >> entry.localHeaderOffset;
+        m_entries.append(entry);
+    }
+    if (stream.status() != QDataStream::Ok)
+    {
+        m_entries.clear();
+        return false;
+    }
+    return true;
+}
+
+void OkArchive::pruneIndex(const QSet<QString> &keepPaths)
+{
+    QSqlDatabase db = indexDatabase();
+    if (!db.isOpen())
+        return;
+    QSqlQuery query(db);
+    if (keepPaths.isEmpty())
+    {
+        query.exec("DELETE FROM archiveIndex");
+        return;
+    }
+    QStringList stale;
+    query.exec("SELECT path FROM archiveIndex");
+    while (query.next())
+    {
+        if (!keepPaths.contains(query.value(0).toString()))
+            stale.append(query.value(0).toString());
+    }
+    if (stale.isEmpty())
+        return;
+    query.exec("BEGIN TRANSACTION");
+    query.prepare("DELETE FROM archiveIndex WHERE path = :path");
+    for (int i=0; i < stale.size(); i++)
+    {
+        query.bindValue(":path", stale.at(i));
+        query.exec();
+    }
+    query.exec("COMMIT TRANSACTION");
+    qWarning() << "OkArchive - Pruned " << stale.size() << " stale archive index entries";
+}
+
+void OkArchive::saveIndex(qint64 size, qint64 mtime)
+{
+    QSqlDatabase db = indexDatabase();
+    if (!db.isOpen())
+        return;
+    QByteArray blob;
+    QDataStream stream(&blob, QIODevice::WriteOnly);
+    stream << (quint32)ZIP_INDEX_VERSION << (quint32)m_entries.size();
+    for (int i=0; i < m_entries.size(); i++)
+    {
+        const zipEntry &entry = m_entries.at(i);
+        stream << entry.fileName << entry.fileSize << entry.compressedSize << entry.compressionMethod << entry.flags << entry.crc << entry.localHeaderOffset;
+    }
+    QSqlQuery query(db);
+    query.prepare("INSERT OR REPLACE INTO archiveIndex (path, size, mtime, entries) VALUES(:path, :size, :mtime, :entries)");
+    query.bindValue(":path", archiveFile);
+    query.bindValue(":size", size);
+    query.bindValue(":mtime", mtime);
+    query.bindValue(":entries", blob);
+    query.exec();
+}
+
 bool OkArchive::extractFile(QString fileName, QString destDir, QString destFile)
 {
     qWarning() << "OkArchive(" << fileName << ", " << destDir << ", " << destFile << ") called";
-    QTemporaryDir tmpDir;
-    QString tmpZipPath = tmpDir.path() + QDir::separator() + "tmp.zip";
-    if (!QFile::copy(archiveFile, tmpZipPath))
+    zipEntry entry;
+    QByteArray data;
+    if ((!findEntry(fileName, entry)) || (!readEntry(entry, data)))
+        return false;
+    QFile outFile(destDir + QDir::separator() + destFile);
+    if ((!outFile.open(QIODevice::WriteOnly)) || (outFile.write(data) != data.size()))
     {
-        qWarning() << "error copying zip";
+        qWarning() << "Error writing extracted file: " << outFile.fileName();
         return false;
     }
-    QStringList arguments;
-    arguments << "-j";
-    arguments << tmpZipPath;
-    arguments << fileName;
-    arguments << "-d";
-    arguments << destDir;
-    process->start(infoZipPath, arguments, QProcess::ReadOnly);
-    process->waitForFinished();
-    if (process->exitCode() == 0)
+    outFile.close();
+    return true;
+}
+
+bool OkArchive::findEntry(QString fileName, zipEntry &entry)
+{
+    getZipContents();
+    for (int i=0; i < m_entries.size(); i++)
+    {
+        if (m_entries.at(i).fileName == fileName)
+        {
+            entry = m_entries.at(i);
+            return true;
+        }
+    }
+    qWarning() << "File " << fileName << " not found in zip: " << archiveFile;
+    return false;
+}
+
+// Checks that an entry can be read and returns the offset of its data, or -1
+static qint64 zipEntryDataOffset(QFile &zipFile, const zipEntry &entry)
+{
+    if (entry.flags & ZIP_FLAG_ENCRYPTED)
     {
-        // no error
+        qWarning() << "Encrypted zip entries aren't supported: " << zipFile.fileName();
+        return -1;
     }
-    else if (process->exitCode() <= 2)
+    if ((entry.compressionMethod != ZIP_METHOD_STORED) && (entry.compressionMethod != ZIP_METHOD_DEFLATED))
     {
-        qWarning() << "Non-fatal error while processing zip: " << archiveFile;
-        qWarning() << "infozip returned error code: " << process->exitCode();
+        qWarning() << "Unsupported compression method " << entry.compressionMethod << " in zip: " << zipFile.fileName();
+        return -1;
     }
-    else if (process->exitCode() >= 3)
+    // The local header repeats the name and has its own extra field, its length can differ from the central directory's
+    uchar local[ZIP_LOCAL_SIZE];
+    if ((!zipFile.seek(entry.localHeaderOffset)) || (zipFile.read((char *)local, ZIP_LOCAL_SIZE) != ZIP_LOCAL_SIZE) || (qFromLittleEndian<quint32>(local) != ZIP_LOCAL_SIGNATURE))
     {
-        qWarning() << "Fatal error while processing zip: " << archiveFile;
-        qWarning() << "infozip returned error code: " << process->exitCode();
+        qWarning() << "Bad local file header in zip: " << zipFile.fileName();
+        return -1;
+    }
+    qint64 dataOffset = entry.localHeaderOffset + ZIP_LOCAL_SIZE + qFromLittleEndian<quint16>(local + 26) + qFromLittleEndian<quint16>(local + 28);
+    if (dataOffset + entry.compressedSize > zipFile.size())
+    {
+        qWarning() << "Truncated zip: " << zipFile.fileName();
+        return -1;
+    }
+    return dataOffset;
+}
+
+bool OkArchive::readEntry(const zipEntry &entry, QByteArray &data)
+{
+    // The sizes come straight from the central directory, don't let a corrupt one decide how much gets allocated
+    if ((entry.fileSize < 0) || (entry.compressedSize < 0) || (entry.fileSize > ZIP_MAX_MEMBER_SIZE) || ((qint64)entry.fileSize > (qint64)entry.compressedSize * ZIP_MAX_RATIO))
+    {
+        qWarning() << "Bad member size for " << entry.fileName << " in zip: " << archiveFile;
+        return false;
+    }
+    QFile zipFile(archiveFile);
+    if (!zipFile.open(QIODevice::ReadOnly))
+        return false;
+    qint64 dataOffset = zipEntryDataOffset(zipFile, entry);
+    if (dataOffset == -1)
         return false;
+    // Map just the member's compressed bytes and inflate from the mapping, falling back to a read if mapping fails
+    QByteArray compressed;
+    const uchar *in = zipFile.map(dataOffset, entry.compressedSize);
+    bool mapped = (in != NULL);
+    if (!mapped)
+    {
+        zipFile.seek(dataOffset);
+        compressed = zipFile.read(entry.compressedSize);
+        if (compressed.size() != entry.compressedSize)
+        {
+            qWarning() << "Truncated zip: " << archiveFile;
+            return false;
+        }
+        in = (const uchar *)compressed.constData();
     }
-    if (!QFile::rename(destDir + QDir::separator() + fileName, destDir + QDir::separator() + destFile))
+    bool result = true;
+    if (entry.compressionMethod == ZIP_METHOD_STORED)
     {
-        qWarning() << "infozip didn't report fatal error, but file was not unzipped successfully";
+        if (mapped)
+            data = QByteArray((const char *)in, entry.compressedSize);
+        else
+            data = compressed;
+    }
+    else
+    {
+        data.resize(entry.fileSize);
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // Negative window bits, zip entries are raw deflate streams without a zlib header
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+            result = false;
+        else
+        {
+            stream.next_in = (Bytef *)in;
+            stream.avail_in = entry.compressedSize;
+            stream.next_out = (Bytef *)data.data();
+            stream.avail_out = data.size();
+            int status = inflate(&stream, Z_FINISH);
+            inflateEnd(&stream);
+            if ((status != Z_STREAM_END) || (stream.total_out != (uLong)entry.fileSize))
+            {
+                qWarning() << "Error inflating " << entry.fileName << " from zip: " << archiveFile;
+                result = false;
+            }
+        }
+    }
+    if (mapped)
+        zipFile.unmap((uchar *)in);
+    if (!result)
+    {
+        data.clear();
+        return false;
+    }
+    if (::crc32(0, (const Bytef *)data.constData(), data.size()) != entry.crc)
+    {
+        qWarning() << "CRC mismatch for " << entry.fileName << " in zip: " << archiveFile;
         return false;
     }
     return true;
+}
 
+bool OkArchive::verifyEntry(const zipEntry &entry)
+{
+    QFile zipFile(archiveFile);
+    if (!zipFile.open(QIODevice::ReadOnly))
+        return false;
+    qint64 dataOffset = zipEntryDataOffset(zipFile, entry);
+    if (dataOffset == -1)
+        return false;
+    const uchar *in = zipFile.map(dataOffset, entry.compressedSize);
+    if (in == NULL)
+    {
+        QByteArray data;
+        return readEntry(entry, data);
+    }
+    // Inflated through a small window and checksummed as it goes, so a member is never held in memory as a whole
+    uLong crc = ::crc32(0, Z_NULL, 0);
+    bool result = true;
+    if (entry.compressionMethod == ZIP_METHOD_STORED)
+        crc = ::crc32(crc, (const Bytef *)in, entry.compressedSize);
+    else
+    {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+            result = false;
+        else
+        {
+            char out[65536];
+            stream.next_in = (Bytef *)in;
+            stream.avail_in = entry.compressedSize;
+            int status = Z_OK;
+            while (status == Z_OK)
+            {
+                stream.next_out = (Bytef *)out;
+                stream.avail_out = sizeof(out);
+                status = inflate(&stream, Z_NO_FLUSH);
+                crc = ::crc32(crc, (const Bytef *)out, sizeof(out) - stream.avail_out);
+            }
+            inflateEnd(&stream);
+            if ((status != Z_STREAM_END) || (stream.total_out != (uLong)entry.fileSize))
+            {
+                qWarning() << "Error inflating " << entry.fileName << " from zip: " << archiveFile;
+                result = false;
+            }
+        }
+    }
+    zipFile.unmap((uchar *)in);
+    if ((result) && (crc != entry.crc))
+    {
+        qWarning() << "CRC mismatch for " << entry.fileName << " in zip: " << archiveFile;
+        result = false;
+    }
+    return result;
 }
 
 bool OkArchive::zipIsValid()
 {
-    QProcess *process = new QProcess(this);
-    QStringList arguments;
-    arguments << "-t";
-    arguments << archiveFile;
-    process->setProcessChannelMode(QProcess::ForwardedChannels);
-    process->start(infoZipPath, arguments, QProcess::ReadOnly);
-    process->waitForFinished();
-    //qWarning() << process->readAll();
-    qWarning() << process->state();
-    qWarning() << process->error();
-    if (process->exitCode() != 0)
-    {
-        process->close();
-        delete process;
+    getZipContents();
+    if (!goodArchive)
         return false;
+    for (int i=0; i < m_entries.size(); i++)
+    {
+        if (!verifyEntry(m_entries.at(i)))
+        {
+            lastError = "Corrupt zip member " + m_entries.at(i).fileName;
+            return false;
+        }
     }
-    else
+    return true;
+}
+
+bool OkArchive::verify()
+{
+    if (!isValidKaraokeFile())
+        return false;
+    if (m_cdgSize % CDG_PACKET_SIZE != 0)
     {
-        process->close();
-        delete process;
-        return true;
+        qWarning() << archiveFile << " - CDG size isn't a whole number of packets";
+        lastError = "Truncated CDG file";
+        return false;
+    }
+    lastError = "Invalid or corrupt zip file";
+    if (!zipIsValid())
+        return false;
+    lastError.clear();
+    return true;
+}
+
+OkArchiveEntryDevice::OkArchiveEntryDevice(QString archiveFile, zipEntry entry, QObject *parent) : QIODevice(parent)
+{
+    zipFile.setFileName(archiveFile);
+    this->entry = entry;
+    dataOffset = -1;
+    inflatePos = 0;
+    compressedLeft = 0;
+    memset(&stream, 0, sizeof(stream));
+    streamInitialized = false;
+}
+
+OkArchiveEntryDevice::~OkArchiveEntryDevice()
+{
+    close();
+}
+
+bool OkArchiveEntryDevice::open(QIODevice::OpenMode mode)
+{
+    if ((mode & QIODevice::WriteOnly) || (!zipFile.open(QIODevice::ReadOnly)))
+        return false;
+    dataOffset = zipEntryDataOffset(zipFile, entry);
+    if (dataOffset == -1)
+    {
+        zipFile.close();
+        return false;
+    }
+    if (entry.compressionMethod == ZIP_METHOD_DEFLATED)
+    {
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        {
+            zipFile.close();
+            return false;
+        }
+        streamInitialized = true;
+    }
+    restart();
+    // Unbuffered, readData() already works in large chunks and seeks are handled here
+    return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void OkArchiveEntryDevice::close()
+{
+    if (streamInitialized)
+        inflateEnd(&stream);
+    streamInitialized = false;
+    zipFile.close();
+    QIODevice::close();
+}
+
+qint64 OkArchiveEntryDevice::size() const
+{
+    return entry.fileSize;
+}
+
+bool OkArchiveEntryDevice::seek(qint64 pos)
+{
+    if ((pos < 0) || (pos > entry.fileSize) || (!QIODevice::seek(pos)))
+        return false;
+    if (entry.compressionMethod == ZIP_METHOD_STORED)
+        return zipFile.seek(dataOffset + pos);
+    // Deflate streams can only be read forwards, going back means starting over
+    if (pos < inflatePos)
+        restart();
+    char discard[16384];
+    while (inflatePos < pos)
+    {
+        if (inflateChunk(discard, qMin((qint64)sizeof(discard), pos - inflatePos)) <= 0)
+            return false;
     }
+    return true;
 }
 
+qint64 OkArchiveEntryDevice::readData(char *data, qint64 maxSize)
+{
+    if (entry.compressionMethod == ZIP_METHOD_STORED)
+        return zipFile.read(data, qMin(maxSize, entry.fileSize - pos()));
+    return inflateChunk(data, maxSize);
+}
+
+qint64 OkArchiveEntryDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
 
+void OkArchiveEntryDevice::restart()
+{
+    zipFile.seek(dataOffset);
+    compressedLeft = entry.compressedSize;
+    inflatePos = 0;
+    if (streamInitialized)
+    {
+        inflateReset(&stream);
+        stream.avail_in = 0;
+    }
+}
+
+qint64 OkArchiveEntryDevice::inflateChunk(char *data, qint64 maxSize)
+{
+    maxSize = qMin(maxSize, (qint64)1048576);
+    stream.next_out = (Bytef *)data;
+    stream.avail_out = maxSize;
+    while (stream.avail_out == (uInt)maxSize)
+    {
+        if ((stream.avail_in == 0) && (compressedLeft > 0))
+        {
+            qint64 bytes = zipFile.read(inBuffer, qMin((qint64)sizeof(inBuffer), compressedLeft));
+            if (bytes <= 0)
+                return -1;
+            compressedLeft -= bytes;
+            stream.next_in = (Bytef *)inBuffer;
+            stream.avail_in = bytes;
+        }
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END)
+            break;
+        if ((result != Z_OK) && (result != Z_BUF_ERROR))
+        {
+            qWarning() << "Error inflating " << entry.fileName << " from zip: " << zipFile.fileName();
+            return -1;
+        }
+        if ((result == Z_BUF_ERROR) && (compressedLeft == 0))
+            return -1;
+    }
+    qint64 bytes = maxSize - stream.avail_out;
+    inflatePos += bytes;
+    return bytes;
+}
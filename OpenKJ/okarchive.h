@@ -24,12 +24,20 @@
 
 #include <QObject>
 #include <QStringList>
-#include <QProcess>
+#include <QSet>
+#include <QIODevice>
+#include <QFile>
+#include <zlib.h>
 
 struct zipEntry
 {
     QString fileName;
     int fileSize;
+    int compressedSize;
+    int compressionMethod;
+    int flags;
+    quint32 crc;
+    qint64 localHeaderOffset;
 };
 
 typedef QList<zipEntry> zipEntries;
@@ -49,8 +57,15 @@ public:
     bool checkAudio();
     QString audioExtension();
     bool extractAudio(QString destPath, QString destFile);
+    // Opens the audio file for reading straight out of the zip, inflating it as it's read.  The caller owns the device.
+    QIODevice *openAudio();
     bool isValidKaraokeFile();
+    // Full integrity check for the library audit: isValidKaraokeFile(), a CDG made of whole packets and the CRC of every
+    // member.  Reads the entire archive.
+    bool verify();
     QString getLastError();
+    // Drops the cached zip directories of archives that aren't in keepPaths, an empty set clears the whole index
+    static void pruneIndex(const QSet<QString> &keepPaths);
 
 private:
     QString archiveFile;
@@ -71,9 +86,13 @@ private:
     bool findEntries();
     QStringList audioExtensions;
     zipEntries getZipContents();
+    bool loadIndex(qint64 size, qint64 mtime);
+    void saveIndex(qint64 size, qint64 mtime);
     bool extractFile(QString fileName, QString destDir, QString destFile);
+    bool findEntry(QString fileName, zipEntry &entry);
+    bool readEntry(const zipEntry &entry, QByteArray &data);
+    bool verifyEntry(const zipEntry &entry);
     bool zipIsValid();
-    QProcess *process;
     bool goodArchive;
 
 signals:
@@ -81,4 +100,34 @@ signals:
 public slots:
 };
 
+// Read-only device over a single zip entry.  Stored entries are read straight from the zip, deflated ones are inflated
+// on the fly.  Seeking forward inflates and discards, seeking backwards restarts from the beginning of the entry.
+class OkArchiveEntryDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    OkArchiveEntryDevice(QString archiveFile, zipEntry entry, QObject *parent = 0);
+    ~OkArchiveEntryDevice();
+    bool open(OpenMode mode);
+    void close();
+    qint64 size() const;
+    bool seek(qint64 pos);
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    QFile zipFile;
+    zipEntry entry;
+    qint64 dataOffset;
+    qint64 inflatePos;
+    qint64 compressedLeft;
+    z_stream stream;
+    bool streamInitialized;
+    char inBuffer[65536];
+    void restart();
+    qint64 inflateChunk(char *data, qint64 maxSize);
+};
+
 #endif // KHARCHIVE_H
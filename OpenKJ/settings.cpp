@@ -53,6 +53,48 @@ void Settings::setStoreDownloadDir(QString path)
     settings->setValue("storeDownloadDir", path);
 }
 
+int Settings::cdgCacheMaxSize()
+{
+    return settings->value("cdgCacheMaxSize", 512).toInt();
+}
+
+void Settings::setCdgCacheMaxSize(int megabytes)
+{
+    settings->setValue("cdgCacheMaxSize", megabytes);
+    emit cdgCacheMaxSizeChanged(megabytes);
+}
+
+int Settings::songCacheMaxSize()
+{
+    return settings->value("songCacheMaxSize", 2048).toInt();
+}
+
+void Settings::setSongCacheMaxSize(int megabytes)
+{
+    settings->setValue("songCacheMaxSize", megabytes);
+    emit songCacheMaxSizeChanged(megabytes);
+}
+
+int Settings::songPrefetchCount()
+{
+    return settings->value("songPrefetchCount", 3).toInt();
+}
+
+void Settings::setSongPrefetchCount(int songs)
+{
+    settings->setValue("songPrefetchCount", songs);
+}
+
+qint64 Settings::auditRunStarted()
+{
+    return settings->value("auditRunStarted", 0).toLongLong();
+}
+
+void Settings::setAuditRunStarted(qint64 started)
+{
+    settings->setValue("auditRunStarted", started);
+}
+
 void Settings::setPassword(QString password)
 {
     qint64 passHash = this->hash(password);
@@ -39,6 +39,10 @@ private:
 public:
     qint64 hash(const QString & str);
     QString storeDownloadDir();
+    int cdgCacheMaxSize();
+    int songCacheMaxSize();
+    int songPrefetchCount();
+    qint64 auditRunStarted();
     void setPassword(QString password);
     void clearPassword();
     bool chkPassword(QString password);
@@ -230,6 +234,8 @@ public:
     int theme();
 
 signals:
+    void cdgCacheMaxSizeChanged(int megabytes);
+    void songCacheMaxSizeChanged(int megabytes);
     void applicationFontChanged(QFont font);
     void tickerFontChanged();
     void tickerHeightChanged(int height);
@@ -349,6 +355,10 @@ public slots:
     void setBookCreatorCols(int cols);
     void setBookCreatorPageSize(int size);
     void setStoreDownloadDir(QString path);
+    void setCdgCacheMaxSize(int megabytes);
+    void setSongCacheMaxSize(int megabytes);
+    void setSongPrefetchCount(int songs);
+    void setAuditRunStarted(qint64 started);
 
 };
 
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "siblingindex.h"
+#include "dirwalker.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+
+#define SIBLING_MAX_DIRS 512
+
+struct SiblingDir
+{
+    qint64 mtime;
+    qint64 listed;
+    QHash<QString, QString> files;
+};
+
+static QMutex siblingMutex;
+static QHash<QString, SiblingDir> siblingDirs;
+
+QString SiblingIndex::key(QString fileName)
+{
+#if defined(Q_OS_WIN) || defined(Q_OS_MAC)
+    // The filesystems there ignore case, Song.cdg goes with song.MP3
+    return fileName.toLower();
+#else
+    int dot = fileName.lastIndexOf('.');
+    if (dot == -1)
+        return fileName;
+    return fileName.left(dot + 1) + fileName.mid(dot + 1).toLower();
+#endif
+}
+
+QString SiblingIndex::companion(QString filePath, QString extension)
+{
+    filePath = QDir::fromNativeSeparators(filePath);
+    int slash = filePath.lastIndexOf('/');
+    int dot = filePath.lastIndexOf('.');
+    if (dot <= slash)
+        return QString();
+    QString dirPath = filePath.left(slash);
+    QString wanted = key(filePath.mid(slash + 1, dot - slash) + extension);
+    QFileInfo dirInfo(dirPath);
+    if (!dirInfo.exists())
+        return QString();
+    qint64 mtime = dirInfo.lastModified().toMSecsSinceEpoch();
+    siblingMutex.lock();
+    QHash<QString, SiblingDir>::const_iterator dir = siblingDirs.constFind(dirPath);
+    if ((dir != siblingDirs.constEnd()) && (dir.value().mtime == mtime) && (mtime < dir.value().listed - DIR_MTIME_SLACK))
+    {
+        QString name = dir.value().files.value(wanted);
+        siblingMutex.unlock();
+        return (name.isEmpty()) ? QString() : dirPath + "/" + name;
+    }
+    siblingMutex.unlock();
+    // Listed without holding the lock, a big directory on a share would stall every other lookup
+    SiblingDir listing;
+    listing.mtime = mtime;
+    listing.listed = QDateTime::currentMSecsSinceEpoch();
+    QStringList names = QDir(dirPath).entryList(QDir::Files, QDir::Unsorted);
+    for (int i=0; i < names.size(); i++)
+        listing.files.insert(key(names.at(i)), names.at(i));
+    QString name = listing.files.value(wanted);
+    siblingMutex.lock();
+    if (siblingDirs.size() >= SIBLING_MAX_DIRS)
+        siblingDirs.clear();
+    siblingDirs.insert(dirPath, listing);
+    siblingMutex.unlock();
+    if (name.isEmpty())
+        return QString();
+    return dirPath + "/" + name;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIBLINGINDEX_H
+#define SIBLINGINDEX_H
+
+#include <QString>
+
+// Finds the files that go with a karaoke file, like the mp3 next to a cdg, whatever the case of their extension.
+// Directories are listed once and the listing is kept for as long as the directory's mtime doesn't change, so finding
+// a companion costs a single stat of the directory rather than a probe for every spelling of the extension.  That
+// matters on network shares, where each probe is a round trip.  Safe to use from any thread.
+
+class SiblingIndex
+{
+public:
+    // File next to filePath with the same base name and the given extension in any case, or an empty string
+    static QString companion(QString filePath, QString extension);
+    // Key a file name is filed under: the base name as is, the extension in lower case.  All lower case on Windows and
+    // macOS, whose filesystems ignore case.
+    static QString key(QString fileName);
+};
+
+#endif // SIBLINGINDEX_H
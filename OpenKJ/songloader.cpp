@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "songloader.h"
+#include "cdgcache.h"
+#include "okarchive.h"
+#include "siblingindex.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QThread>
+#include <QtConcurrent>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+extern CdgCache *cdgCache;
+
+// Files on removable media are copied before playing, so pulling the drive mid song doesn't kill playback.
+// Everything else, including network shares, is played in place.
+static bool isRemovableMedia(QString path)
+{
+    QStorageInfo storage(QFileInfo(path).absolutePath());
+    if ((!storage.isValid()) || (!storage.isReady()))
+        return true;
+#ifdef Q_OS_WIN
+    UINT driveType = GetDriveTypeW((LPCWSTR)QDir::toNativeSeparators(storage.rootPath()).utf16());
+    return ((driveType == DRIVE_REMOVABLE) || (driveType == DRIVE_CDROM));
+#else
+    QString root = storage.rootPath();
+    return (root.startsWith("/media/") || root.startsWith("/run/media/") || root.startsWith("/Volumes/"));
+#endif
+}
+
+// Ask the OS to start reading the file in before the audio backend gets to it
+static void adviseReadAhead(QString path)
+{
+#ifdef Q_OS_LINUX
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly))
+    {
+        posix_fadvise(file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(file.handle(), 0, 0, POSIX_FADV_WILLNEED);
+        file.close();
+    }
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+SongLoader::SongLoader(SongPrefetcher *prefetcher, QObject *parent) : QObject(parent)
+{
+    this->prefetcher = prefetcher;
+    m_request = 0;
+    m_cdg = NULL;
+    m_audioDevice = NULL;
+}
+
+SongLoader::~SongLoader()
+{
+    cancel();
+    workers.waitForFinished();
+    clearResults();
+}
+
+int SongLoader::load(QString karaokeFilePath, QString tmpDir, bool haveCdg)
+{
+    int request = m_request.fetchAndAddOrdered(1) + 1;
+    mutex.lock();
+    clearResults();
+    mutex.unlock();
+    // Only loads that are still running need waiting for on shutdown, drop the rest so the list doesn't keep growing
+    QList<QFuture<void> > running = workers.futures();
+    workers.clearFutures();
+    for (int i=0; i < running.size(); i++)
+    {
+        if (!running.at(i).isFinished())
+            workers.addFuture(running.at(i));
+    }
+    workers.addFuture(QtConcurrent::run(this, &SongLoader::run, request, karaokeFilePath, tmpDir, haveCdg));
+    return request;
+}
+
+void SongLoader::cancel()
+{
+    m_request.fetchAndAddOrdered(1);
+    QMutexLocker locker(&mutex);
+    clearResults();
+}
+
+int SongLoader::currentRequest()
+{
+    return m_request;
+}
+
+CDG *SongLoader::takeCdg()
+{
+    QMutexLocker locker(&mutex);
+    CDG *cdg = m_cdg;
+    m_cdg = NULL;
+    return cdg;
+}
+
+QIODevice *SongLoader::takeAudioDevice()
+{
+    QMutexLocker locker(&mutex);
+    QIODevice *device = m_audioDevice;
+    m_audioDevice = NULL;
+    return device;
+}
+
+QString SongLoader::audioFile()
+{
+    QMutexLocker locker(&mutex);
+    return m_audioFile;
+}
+
+bool SongLoader::isCancelled(int request)
+{
+    return (request != m_request);
+}
+
+void SongLoader::clearResults()
+{
+    delete m_cdg;
+    delete m_audioDevice;
+    m_cdg = NULL;
+    m_audioDevice = NULL;
+    m_audioFile.clear();
+}
+
+void SongLoader::run(int request, QString karaokeFilePath, QString tmpDir, bool haveCdg)
+{
+    emit stageChanged(request, StageLocate);
+    QString localFile = prefetcher->localPath(karaokeFilePath);
+    if (isCancelled(request))
+        return;
+
+    emit stageChanged(request, StageOpen);
+    QByteArray cdgData;
+    QIODevice *audioDevice = NULL;
+    QString audioFile;
+    if (karaokeFilePath.endsWith(".zip", Qt::CaseInsensitive))
+    {
+        OkArchive archive(localFile);
+        if ((!archive.checkCDG()) || (!archive.checkAudio()))
+        {
+            emit failed(request, tr("Zip file does not contain a valid karaoke track.  CDG or audio file missing or corrupt."));
+            return;
+        }
+        // The audio is streamed out of the zip as it plays rather than extracted first
+        audioDevice = archive.openAudio();
+        if (!audioDevice)
+        {
+            emit failed(request, tr("Failed to extract audio file."));
+            return;
+        }
+        if (!haveCdg)
+            cdgData = archive.getCDGData();
+    }
+    else
+    {
+        QFile cdgFile(localFile);
+        if (!cdgFile.exists())
+        {
+            emit failed(request, tr("CDG file missing."));
+            return;
+        }
+        else if (cdgFile.size() == 0)
+        {
+            emit failed(request, tr("CDG file contains no data"));
+            return;
+        }
+        QString mp3fn = SiblingIndex::companion(localFile, "mp3");
+        if (mp3fn.isEmpty())
+        {
+            emit failed(request, tr("mp3 file missing."));
+            return;
+        }
+        if (QFileInfo(mp3fn).size() == 0)
+        {
+            emit failed(request, tr("mp3 file contains no data"));
+            return;
+        }
+        QString cdgPlayFile = localFile;
+        audioFile = mp3fn;
+        if (isRemovableMedia(localFile))
+        {
+            cdgPlayFile = tmpDir + QDir::separator() + QString::number(request) + ".cdg";
+            audioFile = tmpDir + QDir::separator() + QString::number(request) + ".mp3";
+            // QFile::copy() won't overwrite
+            QFile::remove(cdgPlayFile);
+            QFile::remove(audioFile);
+            if ((!cdgFile.copy(cdgPlayFile)) || (!QFile::copy(mp3fn, audioFile)))
+            {
+                qWarning() << "SongLoader - Unable to copy " << localFile << " to " << tmpDir;
+                emit failed(request, tr("Unable to copy the song from removable media."));
+                return;
+            }
+        }
+        if (!haveCdg)
+            cdgData = CdgCache::readCdgData(cdgPlayFile);
+    }
+    if (isCancelled(request))
+    {
+        delete audioDevice;
+        return;
+    }
+
+    emit stageChanged(request, StageDecodeCdg);
+    CDG *cdg = NULL;
+    if (!haveCdg)
+    {
+        cdg = new CDG;
+        if (!cdgCache->open(cdg, cdgData, true))
+        {
+            qWarning() << "SongLoader - Unable to decode cdg data for " << karaokeFilePath;
+            delete cdg;
+            delete audioDevice;
+            emit failed(request, tr("CDG file is corrupt or contains no valid data."));
+            return;
+        }
+    }
+    if (isCancelled(request))
+    {
+        delete cdg;
+        delete audioDevice;
+        return;
+    }
+
+    emit stageChanged(request, StagePrerollAudio);
+    if (audioDevice)
+    {
+        // Created on this thread, but read by GStreamer and deleted by the GUI thread
+        audioDevice->moveToThread(QCoreApplication::instance()->thread());
+    }
+    else
+        adviseReadAhead(audioFile);
+
+    mutex.lock();
+    if (isCancelled(request))
+    {
+        mutex.unlock();
+        delete cdg;
+        delete audioDevice;
+        return;
+    }
+    clearResults();
+    m_cdg = cdg;
+    m_audioDevice = audioDevice;
+    m_audioFile = audioFile;
+    mutex.unlock();
+    emit stageChanged(request, StageReady);
+    emit ready(request);
+}
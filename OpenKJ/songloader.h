@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SONGLOADER_H
+#define SONGLOADER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QIODevice>
+#include <QFutureSynchronizer>
+#include "libCDG/include/libCDG.h"
+#include "songprefetcher.h"
+
+// Loads karaoke songs (zip or cdg) on a worker thread so play() doesn't block the GUI.  A load goes through the
+// stages locate -> open -> decode cdg -> preroll audio -> ready, reporting each with stageChanged().  Starting a new
+// load cancels the previous one, results of cancelled loads are thrown away.
+
+class SongLoader : public QObject
+{
+    Q_OBJECT
+public:
+    enum Stage {
+        StageLocate = 0,
+        StageOpen,
+        StageDecodeCdg,
+        StagePrerollAudio,
+        StageReady
+    };
+    explicit SongLoader(SongPrefetcher *prefetcher, QObject *parent = 0);
+    ~SongLoader();
+    // Starts loading a song and returns the request number.  Copies needed for files on removable media are put in
+    // tmpDir.  If haveCdg is set the caller already has the cdg, so it isn't decoded again.
+    int load(QString karaokeFilePath, QString tmpDir, bool haveCdg);
+    void cancel();
+    int currentRequest();
+    // Results of the last load, collected in the ready() handler.  Ownership passes to the caller.  The cdg is NULL if
+    // haveCdg was set, the audio is either a device or a file.
+    CDG *takeCdg();
+    QIODevice *takeAudioDevice();
+    QString audioFile();
+
+signals:
+    void stageChanged(int request, int stage);
+    void ready(int request);
+    void failed(int request, QString message);
+
+private:
+    SongPrefetcher *prefetcher;
+    QAtomicInt m_request;
+    QMutex mutex;
+    CDG *m_cdg;
+    QIODevice *m_audioDevice;
+    QString m_audioFile;
+    QFutureSynchronizer<void> workers;
+    bool isCancelled(int request);
+    void clearResults();
+    void run(int request, QString karaokeFilePath, QString tmpDir, bool haveCdg);
+};
+
+#endif // SONGLOADER_H
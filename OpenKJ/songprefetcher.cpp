@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "songprefetcher.h"
+#include "settings.h"
+#include "siblingindex.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QStandardPaths>
+#include <QtConcurrent>
+
+extern Settings *settings;
+
+SongPrefetcher::SongPrefetcher(QObject *parent) : QObject(parent)
+{
+    cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QDir::separator() + "songs";
+    QDir().mkpath(cacheDir);
+    // Anything left over from an interrupted copy
+    QStringList partials = QDir(cacheDir).entryList(QStringList() << "*.part", QDir::Files);
+    for (int i=0; i < partials.size(); i++)
+        QFile::remove(cacheDir + QDir::separator() + partials.at(i));
+    planGeneration = 0;
+    workerRunning = false;
+    stopping = 0;
+    m_hits = 0;
+    m_misses = 0;
+    maxSize = settings->songCacheMaxSize();
+    connect(settings, SIGNAL(songCacheMaxSizeChanged(int)), this, SLOT(setMaxSize(int)));
+}
+
+SongPrefetcher::~SongPrefetcher()
+{
+    stopping = 1;
+    worker.waitForFinished();
+}
+
+QString SongPrefetcher::localPath(QString karaokeFilePath)
+{
+    if (maxSize <= 0)
+        return karaokeFilePath;
+    QStringList sources = sourceFiles(karaokeFilePath);
+    if (sources.isEmpty())
+        return karaokeFilePath;
+    if (!allCached(karaokeFilePath, sources))
+    {
+        m_misses++;
+        mutex.lock();
+        inUseKey.clear();
+        mutex.unlock();
+        qWarning() << "SongPrefetcher - Miss: " << karaokeFilePath << " (" << m_hits << " hits, " << m_misses << " misses)";
+        return karaokeFilePath;
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    // Touch the files so eviction sees them as recently used
+    for (int i=0; i < sources.size(); i++)
+    {
+        QFile file(cacheFile(karaokeFilePath, sources.at(i)));
+        if (file.open(QIODevice::ReadWrite))
+        {
+            file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+            file.close();
+        }
+    }
+#endif
+    // The copy is about to be played, eviction has to leave it alone
+    mutex.lock();
+    inUseKey = cacheKey(karaokeFilePath);
+    mutex.unlock();
+    m_hits++;
+    qWarning() << "SongPrefetcher - Hit: " << karaokeFilePath << " (" << m_hits << " hits, " << m_misses << " misses)";
+    return cacheFile(karaokeFilePath, sources.first());
+}
+
+QString SongPrefetcher::cachedPath(QString karaokeFilePath)
+{
+    if (maxSize <= 0)
+        return karaokeFilePath;
+    QStringList sources = sourceFiles(karaokeFilePath);
+    if ((sources.isEmpty()) || (!allCached(karaokeFilePath, sources)))
+        return karaokeFilePath;
+    return cacheFile(karaokeFilePath, sources.first());
+}
+
+void SongPrefetcher::setPlan(QStringList karaokeFilePaths)
+{
+    QMutexLocker locker(&mutex);
+    if (karaokeFilePaths == plan)
+        return;
+    plan = karaokeFilePaths;
+    planGeneration++;
+    if ((maxSize > 0) && (!plan.isEmpty()) && (!workerRunning))
+    {
+        workerRunning = true;
+        worker = QtConcurrent::run(this, &SongPrefetcher::processPlan);
+    }
+}
+
+int SongPrefetcher::hits() const
+{
+    return m_hits;
+}
+
+int SongPrefetcher::misses() const
+{
+    return m_misses;
+}
+
+void SongPrefetcher::setMaxSize(int megabytes)
+{
+    maxSize = megabytes;
+}
+
+QStringList SongPrefetcher::sourceFiles(QString karaokeFilePath)
+{
+    QStringList files;
+    if (karaokeFilePath.endsWith(".zip", Qt::CaseInsensitive))
+        files << karaokeFilePath;
+    else if (karaokeFilePath.endsWith(".cdg", Qt::CaseInsensitive))
+    {
+        QString audioFile = SiblingIndex::companion(karaokeFilePath, "mp3");
+        if (!audioFile.isEmpty())
+            files << karaokeFilePath << audioFile;
+    }
+    return files;
+}
+
+QString SongPrefetcher::cacheKey(QString karaokeFilePath)
+{
+    // Named after the song rather than the file, so a cdg and its audio keep a common base name
+    return QCryptographicHash::hash(karaokeFilePath.toUtf8(), QCryptographicHash::Sha1).toHex();
+}
+
+QString SongPrefetcher::cacheFile(QString karaokeFilePath, QString sourceFile)
+{
+    return cacheDir + QDir::separator() + cacheKey(karaokeFilePath) + "." + QFileInfo(sourceFile).suffix();
+}
+
+bool SongPrefetcher::isCached(QString sourceFile, QString cachedFile)
+{
+    // The cached file's own mtime tracks when it was last used, the source's mtime at copy time is kept next to it
+    QFileInfo cached(cachedFile);
+    if (!cached.exists())
+        return false;
+    QFile sidecar(cachedFile + ".src");
+    if (!sidecar.open(QIODevice::ReadOnly))
+        return false;
+    qint64 sourceMtime = sidecar.readAll().trimmed().toLongLong();
+    sidecar.close();
+    QFileInfo source(sourceFile);
+    return ((source.size() == cached.size()) && (source.lastModified().toMSecsSinceEpoch() == sourceMtime));
+}
+
+bool SongPrefetcher::allCached(QString karaokeFilePath, QStringList sources)
+{
+    for (int i=0; i < sources.size(); i++)
+    {
+        if (!isCached(sources.at(i), cacheFile(karaokeFilePath, sources.at(i))))
+            return false;
+    }
+    return true;
+}
+
+bool SongPrefetcher::isPlanned(QString karaokeFilePath)
+{
+    QMutexLocker locker(&mutex);
+    return plan.contains(karaokeFilePath);
+}
+
+bool SongPrefetcher::copyFile(QString karaokeFilePath, QString sourceFile, QString cachedFile)
+{
+    // Taken before copying, a source changed while it's copied then doesn't match next time
+    qint64 sourceMtime = QFileInfo(sourceFile).lastModified().toMSecsSinceEpoch();
+    QFile in(sourceFile);
+    QFile out(cachedFile + ".part");
+    if ((!in.open(QIODevice::ReadOnly)) || (!out.open(QIODevice::WriteOnly)))
+        return false;
+    QByteArray buffer;
+    // Copied in chunks so a song that drops out of the plan stops copying right away
+    while (!in.atEnd())
+    {
+        if ((stopping) || (!isPlanned(karaokeFilePath)))
+        {
+            out.close();
+            out.remove();
+            return false;
+        }
+        buffer = in.read(1048576);
+        if ((buffer.isEmpty()) || (out.write(buffer) != buffer.size()))
+        {
+            qWarning() << "SongPrefetcher - Error copying " << sourceFile;
+            out.close();
+            out.remove();
+            return false;
+        }
+    }
+    out.close();
+    QFile::remove(cachedFile);
+    if (!out.rename(cachedFile))
+        return false;
+    QFile sidecar(cachedFile + ".src");
+    if ((!sidecar.open(QIODevice::WriteOnly)) || (sidecar.write(QByteArray::number(sourceMtime)) <= 0))
+    {
+        QFile::remove(cachedFile);
+        return false;
+    }
+    sidecar.close();
+    return true;
+}
+
+void SongPrefetcher::evict()
+{
+    qint64 maxBytes = (qint64)maxSize * 1024 * 1024;
+    QDir dir(cacheDir);
+    // Newest first, anything past the size cap goes
+    QFileInfoList entries = dir.entryInfoList(QDir::Files, QDir::Time);
+    mutex.lock();
+    QString inUse = inUseKey;
+    mutex.unlock();
+    qint64 total = 0;
+    for (int i=0; i < entries.size(); i++)
+    {
+        if ((entries.at(i).suffix() == "part") || (entries.at(i).suffix() == "src"))
+            continue;
+        total += entries.at(i).size();
+        // The song handed out last may be playing right now
+        if ((total > maxBytes) && (entries.at(i).completeBaseName() != inUse))
+        {
+            QFile::remove(entries.at(i).absoluteFilePath());
+            QFile::remove(entries.at(i).absoluteFilePath() + ".src");
+        }
+    }
+}
+
+void SongPrefetcher::processPlan()
+{
+    int generation = -1;
+    forever
+    {
+        mutex.lock();
+        if ((stopping) || (generation == planGeneration))
+        {
+            workerRunning = false;
+            mutex.unlock();
+            return;
+        }
+        generation = planGeneration;
+        QStringList songs = plan;
+        mutex.unlock();
+        for (int s=0; s < songs.size(); s++)
+        {
+            if ((stopping) || (!isPlanned(songs.at(s))))
+                continue;
+            QStringList sources = sourceFiles(songs.at(s));
+            bool copied = false;
+            for (int i=0; i < sources.size(); i++)
+            {
+                QString cached = cacheFile(songs.at(s), sources.at(i));
+                if (isCached(sources.at(i), cached))
+                    continue;
+                if (!copyFile(songs.at(s), sources.at(i), cached))
+                    break;
+                copied = true;
+            }
+            if (copied)
+                evict();
+        }
+    }
+}
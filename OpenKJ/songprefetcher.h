@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2013-2017 Thomas Isaac Lightburn
+ *
+ *
+ * This file is part of OpenKJ.
+ *
+ * OpenKJ is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SONGPREFETCHER_H
+#define SONGPREFETCHER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QMutex>
+#include <QFuture>
+#include <QAtomicInt>
+
+// Copies the next songs in the rotation from (possibly slow network) storage into a local cache in the background, so
+// play() can open the local copy.  The cache is capped at Settings::songCacheMaxSize() megabytes, least recently used
+// songs are removed first.
+
+class SongPrefetcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SongPrefetcher(QObject *parent = 0);
+    ~SongPrefetcher();
+    // Returns the local copy of a karaoke file (zip or cdg) if it has been prefetched, otherwise the original path.
+    // For cdg files the audio file is next to the returned copy, with the same base name.
+    QString localPath(QString karaokeFilePath);
+    // Same as localPath(), but doesn't count as a use of the copy.  For readers that aren't about to play the song.
+    QString cachedPath(QString karaokeFilePath);
+    // Replaces the list of songs to prefetch, in order.  Songs dropped from the list stop copying.
+    void setPlan(QStringList karaokeFilePaths);
+    int hits() const;
+    int misses() const;
+
+public slots:
+    void setMaxSize(int megabytes);
+
+private:
+    QString cacheDir;
+    QMutex mutex;
+    QStringList plan;
+    int planGeneration;
+    bool workerRunning;
+    QFuture<void> worker;
+    QAtomicInt stopping;
+    // Copy of Settings::songCacheMaxSize(), the settings object can't be used from the worker thread
+    QAtomicInt maxSize;
+    // localPath() is called from the song loader's worker threads
+    QAtomicInt m_hits;
+    QAtomicInt m_misses;
+    // Cache key of the song localPath() last returned a copy for
+    QString inUseKey;
+    QString cacheKey(QString karaokeFilePath);
+    QStringList sourceFiles(QString karaokeFilePath);
+    QString cacheFile(QString karaokeFilePath, QString sourceFile);
+    bool isCached(QString sourceFile, QString cachedFile);
+    bool allCached(QString karaokeFilePath, QStringList sources);
+    bool isPlanned(QString karaokeFilePath);
+    bool copyFile(QString karaokeFilePath, QString sourceFile, QString cachedFile);
+    void evict();
+    void processPlan();
+};
+
+#endif // SONGPREFETCHER_H